@@ -0,0 +1,10 @@
+uniform sampler2D Image;
+uniform sampler2D Pallet;
+
+out vec4 FragmentColor;
+
+void main(void)
+{
+    int Index = int(texelFetch(Image, ivec2(gl_FragCoord.xy), 0).r * 255.0 + 0.5);
+    FragmentColor = texelFetch(Pallet, ivec2(Index, 0), 0);
+}
\ No newline at end of file
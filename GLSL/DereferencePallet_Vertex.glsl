@@ -0,0 +1,6 @@
+in vec4 VertP;
+
+void main(void)
+{
+	gl_Position = VertP;
+}
\ No newline at end of file
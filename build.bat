@@ -6,7 +6,7 @@ call "C:\Program Files\Microsoft Visual Studio\2022\Community\VC\Auxiliary\Build
 set DebugFlags=/DPAINTTOOL_CODE_VERIFICATION=1 /Od
 set CommonFlags=/GR- /GL /Gw /MT /Oi /nologo /FC /Zi
 set WarningFlags=/W4 /WX /wd4100 /wd4201 /wd4310
-set LinkerFlags=/link /INCREMENTAL:NO /OPT:REF User32.lib Shell32.lib Kernel32.lib Gdi32.lib Opengl32.lib
+set LinkerFlags=/link /INCREMENTAL:NO /OPT:REF User32.lib Shell32.lib Kernel32.lib Gdi32.lib Opengl32.lib Synchronization.lib
 
 IF NOT EXIST %~dp0\..\build mkdir %~dp0\..\build
 pushd %~dp0\..\build
@@ -251,7 +251,7 @@ RLE4(void *SourceData, void *DataEndpoint, void *PalletData, u32 PalletSize,
 }
 
 b32
-BMP_Reader(BMP_CoreBitmapHeader *BitmapHeader, void *FileEndpoint, void *BitmapData)
+BMP_Reader(BMP_CoreBitmapHeader *BitmapHeader, void *FileEndpoint, void *BitmapData, image_probe *Probe)
 {
     // TODO(Zyonji): Implement a decoder for the core bitmap format.
     LogError("The BMP file uses an unsupported core bitmap format.", "BMP Reader");
@@ -259,7 +259,7 @@ BMP_Reader(BMP_CoreBitmapHeader *BitmapHeader, void *FileEndpoint, void *BitmapD
 }
 
 b32
-BMP_Reader(BMP_Os2BitmapHeader *BitmapHeader, void *FileEndpoint, void *BitmapData)
+BMP_Reader(BMP_Os2BitmapHeader *BitmapHeader, void *FileEndpoint, void *BitmapData, image_probe *Probe)
 {
     // TODO(Zyonji): Implement a decoder for the OS/2 specific format.
     LogError("The BMP file uses an unsupported OS/2 specific format.", "BMP Reader");
@@ -267,7 +267,7 @@ BMP_Reader(BMP_Os2BitmapHeader *BitmapHeader, void *FileEndpoint, void *BitmapDa
 }
 
 b32
-BMP_Reader(BMP_Win32BitmapHeader *BitmapHeader, void *FileEndpoint, void *BitmapData)
+BMP_Reader(BMP_Win32BitmapHeader *BitmapHeader, void *FileEndpoint, void *BitmapData, image_probe *Probe)
 {
     u8 *HeaderStart = (u8 *)BitmapHeader;
     if(HeaderStart + BitmapHeader->Size >= FileEndpoint)
@@ -363,6 +363,10 @@ BMP_Reader(BMP_Win32BitmapHeader *BitmapHeader, void *FileEndpoint, void *Bitmap
     
     if(BitmapHeader->BitsPerPixel == 0 || BitmapHeader->Compression == BMP_COMPRESSION_JPEG || BitmapHeader->Compression == BMP_COMPRESSION_PNG)
     {
+        if(Probe)
+        {
+            return(ProbeImageFromData(BitmapData, FileEndpoint, Probe));
+        }
         LogError("The recursive JPEG/PNG decoding step is untested.", "BMP Reader");
         return(DisplayImageFromData(BitmapData, FileEndpoint));
     }
@@ -370,6 +374,16 @@ BMP_Reader(BMP_Win32BitmapHeader *BitmapHeader, void *FileEndpoint, void *Bitmap
     {
         // TODO(Zyonji): Set a maximum size for image buffers
         u64 BufferSize = 4 * (u64)Processor.Width * (u64)Processor.Height;
+        Processor.BitsPerPixel       = 32;
+        Processor.PalletData         = 0;
+        Processor.PalletSize         = 0;
+        Processor.BitsPerPalletColor = 0;
+        if(Probe)
+        {
+            SetImageProbe(Probe, Processor, false, 1, BufferSize, BufferSize);
+            return(true);
+        }
+        
         void *BitmapBuffer = RequestImageBuffer(BufferSize);
         void *BitmapBufferEndpoint = (u8 *)BitmapBuffer + BufferSize;
         
@@ -382,11 +396,6 @@ BMP_Reader(BMP_Win32BitmapHeader *BitmapHeader, void *FileEndpoint, void *Bitmap
         RLE8(BitmapData, FileEndpoint, PaletteMemory, PalletSize,
              BitmapBuffer, BitmapBufferEndpoint, BitmapHeader->Width);
         
-        Processor.BitsPerPixel       = 32;
-        Processor.PalletData         = 0;
-        Processor.PalletSize         = 0;
-        Processor.BitsPerPalletColor = 0;
-        
         StoreImage(BitmapBuffer, Processor);
         FreeImageBuffer(BitmapBuffer);
     }
@@ -394,6 +403,16 @@ BMP_Reader(BMP_Win32BitmapHeader *BitmapHeader, void *FileEndpoint, void *Bitmap
     {
         // TODO(Zyonji): Set a maximum size for image buffers
         u64 BufferSize = 4 * (u64)Processor.Width * (u64)Processor.Height;
+        Processor.BitsPerPixel       = 32;
+        Processor.PalletData         = 0;
+        Processor.PalletSize         = 0;
+        Processor.BitsPerPalletColor = 0;
+        if(Probe)
+        {
+            SetImageProbe(Probe, Processor, false, 1, BufferSize, BufferSize);
+            return(true);
+        }
+        
         void *BitmapBuffer = RequestImageBuffer(BufferSize);
         void *BitmapBufferEndpoint = (u8 *)BitmapBuffer + BufferSize;
         
@@ -406,11 +425,6 @@ BMP_Reader(BMP_Win32BitmapHeader *BitmapHeader, void *FileEndpoint, void *Bitmap
         RLE4(BitmapData, FileEndpoint, PaletteMemory, PalletSize,
              BitmapBuffer, BitmapBufferEndpoint, BitmapHeader->Width);
         
-        Processor.BitsPerPixel       = 32;
-        Processor.PalletData         = 0;
-        Processor.PalletSize         = 0;
-        Processor.BitsPerPalletColor = 0;
-        
         StoreImage(BitmapBuffer, Processor);
         FreeImageBuffer(BitmapBuffer);
     }
@@ -424,6 +438,12 @@ BMP_Reader(BMP_Win32BitmapHeader *BitmapHeader, void *FileEndpoint, void *Bitmap
             return(false);
         }
         
+        // The bitmap gets stored straight out of the file.
+        if(Probe)
+        {
+            SetImageProbe(Probe, Processor, false, 1, 0, BytesPerRow * (u64)Processor.Height);
+            return(true);
+        }
         StoreImage(BitmapData, Processor);
     }
     
@@ -431,7 +451,7 @@ BMP_Reader(BMP_Win32BitmapHeader *BitmapHeader, void *FileEndpoint, void *Bitmap
 }
 
 b32
-BMP_Reader(void *FileMemory, void *FileEndpoint)
+BMP_Reader(void *FileMemory, void *FileEndpoint, image_probe *Probe)
 {
     BMP_FileHeader *FileHeader = (BMP_FileHeader *)FileMemory;
     if(FileHeader + 1 > FileEndpoint || FileHeader->Signature != BMP_SIGNATURE || FileHeader->Reserved != 0)
@@ -444,14 +464,14 @@ BMP_Reader(void *FileMemory, void *FileEndpoint)
     
     if(FileHeader->BitmapHeaderSize == 12)
     {
-        return(BMP_Reader((BMP_CoreBitmapHeader *)BitmapHeader, FileEndpoint, BitmapData));
+        return(BMP_Reader((BMP_CoreBitmapHeader *)BitmapHeader, FileEndpoint, BitmapData, Probe));
     }
     else if(FileHeader->BitmapHeaderSize == 16 || FileHeader->BitmapHeaderSize == 64)
     {
-        return(BMP_Reader((BMP_Os2BitmapHeader *)BitmapHeader, FileEndpoint, BitmapData));
+        return(BMP_Reader((BMP_Os2BitmapHeader *)BitmapHeader, FileEndpoint, BitmapData, Probe));
     }
     else
     {
-        return(BMP_Reader((BMP_Win32BitmapHeader *)BitmapHeader, FileEndpoint, BitmapData));
+        return(BMP_Reader((BMP_Win32BitmapHeader *)BitmapHeader, FileEndpoint, BitmapData, Probe));
     }
 }
\ No newline at end of file
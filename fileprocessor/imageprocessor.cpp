@@ -1,4 +1,39 @@
 b32 DisplayImageFromData(void*, void*);
+b32 DisplayImageRegionFromData(void*, void*, image_region);
+b32 ProbeImageFromData(void*, void*, image_probe*);
+void SetImageProbe(image_probe*, image_processor_tasks, b32, u32, u64, u64);
+u32 GetConversionPalletSize(u32);
+void PrepareConversion(image_conversion*, image_processor_tasks, u32*, b32);
+void ConvertRows(image_conversion*, void*, void*, u32, u32);
+void ConvertRowsInBands(image_conversion*, void*, void*, u32, u32);
+u32 SplitConversionBands(conversion_band*, image_conversion*, void*, void*, u32, u32, u64 volatile*);
+void ConvertBand(void*);
+
+// The CPU is only queried once, the result is kept for every following image.
+static cpu_features
+GetCPUFeatures()
+{
+    static cpu_features Features;
+    static b32 FeaturesQueried;
+    if(!FeaturesQueried)
+    {
+        s32 Info[4];
+        __cpuid(Info, 0);
+        s32 HighestLeaf = Info[0];
+        
+        __cpuid(Info, 1);
+        Features.PCLMUL = (Info[2] >> 1) & 1;
+        Features.SSSE3  = (Info[2] >> 9) & 1;
+        b32 OSSavesYMM = ((Info[2] >> 27) & 1) && ((Info[2] >> 28) & 1) && ((_xgetbv(0) & 6) == 6);
+        if(HighestLeaf >= 7 && OSSavesYMM)
+        {
+            __cpuidex(Info, 7, 0);
+            Features.AVX2 = (Info[1] >> 5) & 1;
+        }
+        FeaturesQueried = true;
+    }
+    return(Features);
+}
 
 #include "png.cpp"
 #include "jpeg.cpp"
@@ -7,18 +42,55 @@ b32 DisplayImageFromData(void*, void*);
 b32
 DisplayImageFromData(void *FileMemory, void *FileEndpoint)
 {
-    if(PNG_Reader(FileMemory, FileEndpoint))
+    if(PNG_Reader(FileMemory, FileEndpoint, 0, 0))
         return(true);
     
-    if(JPEG_Reader(FileMemory, FileEndpoint))
+    if(JPEG_Reader(FileMemory, FileEndpoint, 0))
         return(true);
     
-    if(BMP_Reader(FileMemory, FileEndpoint))
+    if(BMP_Reader(FileMemory, FileEndpoint, 0))
         return(true);
     
     return(false);
 }
 
+// Only stores the given region of the image. So far only PNG images get decoded in parts.
+b32
+DisplayImageRegionFromData(void *FileMemory, void *FileEndpoint, image_region Region)
+{
+    return(PNG_Reader(FileMemory, FileEndpoint, &Region, 0));
+}
+
+// Reads only the headers and fills in the probe, nothing gets allocated, decoded or stored.
+b32
+ProbeImageFromData(void *FileMemory, void *FileEndpoint, image_probe *Probe)
+{
+    if(PNG_Reader(FileMemory, FileEndpoint, 0, Probe))
+        return(true);
+    
+    if(JPEG_Reader(FileMemory, FileEndpoint, Probe))
+        return(true);
+    
+    if(BMP_Reader(FileMemory, FileEndpoint, Probe))
+        return(true);
+    
+    return(false);
+}
+
+// The readers call this right before they would request their buffer. The pallet of the stored image
+// isn't in place yet at that point, so it's left out.
+void
+SetImageProbe(image_probe *Probe, image_processor_tasks Processor, b32 Interlaced, u32 FrameCount,
+              u64 BufferSize, u64 OutputSize)
+{
+    Probe->Processor            = Processor;
+    Probe->Processor.PalletData = 0;
+    Probe->Interlaced           = Interlaced;
+    Probe->FrameCount           = FrameCount;
+    Probe->BufferSize           = BufferSize;
+    Probe->OutputSize           = OutputSize;
+}
+
 // Channel masks are expected to be contiguous.
 channel_location
 GetChannelLocation(u64 ChannelMask)
@@ -40,62 +112,283 @@ GetChannelLocation(u64 ChannelMask)
     return(Location);
 }
 
-// TODO(Zyonji): For future optimization, consider in memory operations and SIMD operations.
+// Multiplier, add and shift for channels of 0 to 8 bits. Those of 1, 2, 4 and 8 bits just repeat the bits,
+// the others were searched to round exactly like the float conversion Value * 255.0f / Maximum + 0.5f.
+// All products stay below 2^16.
+static u16 CHANNEL_SCALES[9][3] = {
+    {0, 0, 0}, {255, 0, 0}, {85, 0, 0}, {73, 0, 1}, {17, 0, 0}, {527, 23, 6}, {259, 33, 6}, {129, 0, 6}, {1, 0, 0},
+};
+
+inline channel_scale
+GetChannelScale(u64 ChannelMask)
+{
+    channel_location Location = GetChannelLocation(ChannelMask);
+    channel_scale Scale = {};
+    Scale.BitCount = Location.BitCount;
+    if(Location.BitCount > 8)
+    {
+        Scale.Multiplier = U8Max;
+        Scale.Add        = (ChannelMask >> Location.Offset) / 2;
+        Scale.Shift      = Location.BitCount;
+    }
+    else
+    {
+        Scale.Multiplier = CHANNEL_SCALES[Location.BitCount][0];
+        Scale.Add        = CHANNEL_SCALES[Location.BitCount][1];
+        Scale.Shift      = CHANNEL_SCALES[Location.BitCount][2];
+    }
+    return(Scale);
+}
+
+inline u8
+ScaleChannelToU8(u64 Value, channel_scale Scale)
+{
+    u64 Scaled = Value * Scale.Multiplier + Scale.Add;
+    if(Scale.BitCount > 8)
+    {
+        // Dividing by 2^n - 1 as (x + 1 + (x >> n)) >> n is exact for every x below 2^2n.
+        Scaled += 1 + (Scaled >> Scale.Shift);
+    }
+    return((u8)(Scaled >> Scale.Shift));
+}
+
+// The channel_scale and location of one channel, spread over the 32 bit lanes of four pixels.
+struct channel_lanes
+{
+    __m128i Mask;
+    __m128i Offset;
+    __m128i Multiplier;
+    __m128i Add;
+    __m128i Shift;
+    b32 Wide;
+};
+
+// Only channels of up to 16 bits inside the low 32 bits of the pixel fit into the lanes.
+inline b32
+FillChannelLanes(channel_lanes *Lanes, u64 ChannelMask)
+{
+    channel_location Location = GetChannelLocation(ChannelMask);
+    channel_scale Scale = GetChannelScale(ChannelMask);
+    Lanes->Mask       = _mm_set1_epi32((s32)ChannelMask);
+    Lanes->Offset     = _mm_cvtsi32_si128(Location.Offset);
+    Lanes->Multiplier = _mm_set1_epi32((s32)Scale.Multiplier);
+    Lanes->Add        = _mm_set1_epi32((s32)Scale.Add);
+    Lanes->Shift      = _mm_cvtsi32_si128((s32)Scale.Shift);
+    Lanes->Wide       = (Scale.BitCount > 8);
+    return(ChannelMask <= U32Max && Scale.BitCount <= 16);
+}
+
+inline __m128i
+ScaleChannelLanesToU8(__m128i Pixels, channel_lanes *Lanes)
+{
+    __m128i Values = _mm_srl_epi32(_mm_and_si128(Pixels, Lanes->Mask), Lanes->Offset);
+    __m128i Scaled;
+    if(Lanes->Wide)
+    {
+        // Values * 255 reaches up to 24 bits, too much for a 16 bit multiply.
+        Scaled = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(Values, 8), Values), Lanes->Add);
+        Scaled = _mm_add_epi32(Scaled, _mm_add_epi32(_mm_srl_epi32(Scaled, Lanes->Shift), _mm_set1_epi32(1)));
+    }
+    else
+    {
+        // The upper 16 bits of the lanes are 0 on both sides, so the 16 bit multiply does.
+        Scaled = _mm_add_epi32(_mm_mullo_epi16(Values, Lanes->Multiplier), Lanes->Add);
+    }
+    return(_mm_srl_epi32(Scaled, Lanes->Shift));
+}
+
+// Converts four pixels in the 32 bit lanes to RGBA8. Those that match the key lose their alpha.
+inline __m128i
+RearrangeChannelLanesToU32(__m128i Pixels, channel_lanes *Lanes, __m128i AlphaFill,
+                           __m128i KeyMask, __m128i KeyValue)
+{
+    __m128i Red   = ScaleChannelLanesToU8(Pixels, Lanes + 0);
+    __m128i Green = ScaleChannelLanesToU8(Pixels, Lanes + 1);
+    __m128i Blue  = ScaleChannelLanesToU8(Pixels, Lanes + 2);
+    __m128i Alpha = ScaleChannelLanesToU8(Pixels, Lanes + 3);
+    __m128i Result = _mm_or_si128(Red, _mm_slli_epi32(Green, 8));
+    Result = _mm_or_si128(Result, _mm_slli_epi32(Blue, 16));
+    Result = _mm_or_si128(Result, _mm_slli_epi32(Alpha, 24));
+    Result = _mm_or_si128(Result, AlphaFill);
+    __m128i Keyed = _mm_cmpeq_epi32(_mm_and_si128(Pixels, KeyMask), KeyValue);
+    return(_mm_andnot_si128(_mm_slli_epi32(Keyed, 24), Result));
+}
+
+static color_key NO_COLOR_KEY = {0, 1};
 
+// Turns the transparent color, stored as the bytes of a pixel, into the pixel value the kernels compare
+// against. Pixels smaller than a byte hold the color in the high bits of the first byte.
+color_key
+GetColorKey(u64 TransparentColor, u64 ChannelMasks, u32 BitsPerPixel, b32 BigEndian)
+{
+    color_key Key = NO_COLOR_KEY;
+    if(TransparentColor)
+    {
+        u64 Pixel = TransparentColor;
+        if(BitsPerPixel < 8)
+        {
+            Pixel = (TransparentColor & 0xff) >> (8 - BitsPerPixel);
+        }
+        else if(BigEndian)
+        {
+            Pixel = SwapEndian(TransparentColor);
+        }
+        Key.Mask  = ChannelMasks;
+        Key.Value = Pixel & ChannelMasks;
+    }
+    return(Key);
+}
+
+// Fills in the colors of the 8, 4 or 2 pixels of every possible byte of 1, 2 or 4 bit pixels, from the colors of
+// the pixel values. Values past the end of the colors become transparent black.
 void
-DereferenceColorIndexByte(void *Source, void *Target, u32 *PalletData, u32 PalletSize,
-                          u32 Width, u32 Height, u32 BytesPerRow, u8 BitsPerPixel)
+BuildByteColors(u32 *ByteColors, u32 *Colors, u32 ColorCount, u8 BitsPerPixel)
 {
-    u8 BitMask = (1 << BitsPerPixel) - 1;
+    u32 PixelsPerByte = 8 / BitsPerPixel;
+    u32 BitMask = (1 << BitsPerPixel) - 1;
+    for(u32 Byte = 0; Byte < 256; Byte++)
+    {
+        for(u32 Pixel = 0; Pixel < PixelsPerByte; Pixel++)
+        {
+            u32 Value = (Byte >> (8 - BitsPerPixel * (Pixel + 1))) & BitMask;
+            ByteColors[Byte * PixelsPerByte + Pixel] = (Value < ColorCount) ? Colors[Value] : 0;
+        }
+    }
+}
+
+// Every byte of 1, 2 or 4 bit pixels gets its 8, 4 or 2 colors copied in one go from the table built by
+// BuildByteColors. The rows start with the pixel at FirstColumn, which can lie inside a byte.
+void
+ExpandPixelBytes(void *Source, void *Target, u32 *ByteColors, u32 FirstColumn,
+                 u32 Width, u32 Height, u32 BytesPerRow, u8 BitsPerPixel)
+{
+    u32 PixelsPerByte = 8 / BitsPerPixel;
     u32 *To = (u32 *)Target;
-    u8 *Row = (u8 *)Source;
-    u32 LinesRemaining = Height;
-    while(LinesRemaining--)
+    u8 *Row = (u8 *)Source + FirstColumn / PixelsPerByte;
+    for(u32 Y = 0; Y < Height; Y++)
     {
-        u8 *From            = Row;
-        u32 PixelsRemaining = Width;
-        u8  CurrentByte     = 0;
-        u8  Shifts          = 0;
-        while(PixelsRemaining--)
+        u8 *From = Row;
+        u32 PixelsLeft = Width;
+        u32 Skipped = FirstColumn % PixelsPerByte;
+        if(Skipped && PixelsLeft)
         {
-            if(Shifts == 0)
+            u32 *Colors = ByteColors + *(From++) * PixelsPerByte;
+            for(u32 Pixel = Skipped; Pixel < PixelsPerByte && PixelsLeft; Pixel++, PixelsLeft--)
             {
-                CurrentByte = *(From++);
-                Shifts = 8;
+                *(To++) = Colors[Pixel];
             }
-            
-            Shifts -= BitsPerPixel;
-            u8 Index = (CurrentByte >> Shifts) & BitMask;
-            if(Index < PalletSize)
+        }
+        
+        u8 *End = From + PixelsLeft / PixelsPerByte;
+        if(BitsPerPixel == 1)
+        {
+            for(; From < End; From++, To += 8)
             {
-                *(To++) = PalletData[Index];
+                __m128i *Colors = (__m128i *)(ByteColors + *From * 8);
+                _mm_storeu_si128((__m128i *)To,     _mm_loadu_si128(Colors));
+                _mm_storeu_si128((__m128i *)To + 1, _mm_loadu_si128(Colors + 1));
+            }
+        }
+        else if(BitsPerPixel == 2)
+        {
+            for(; From < End; From++, To += 4)
+            {
+                _mm_storeu_si128((__m128i *)To, _mm_loadu_si128((__m128i *)(ByteColors + *From * 4)));
+            }
+        }
+        else
+        {
+            for(; From < End; From++, To += 2)
+            {
+                *(u64 *)To = *(u64 *)(ByteColors + *From * 2);
+            }
+        }
+        
+        // The last byte only holds some of the pixels.
+        PixelsLeft %= PixelsPerByte;
+        if(PixelsLeft)
+        {
+            u32 *Colors = ByteColors + *From * PixelsPerByte;
+            while(PixelsLeft--)
+            {
+                *(To++) = *(Colors++);
             }
         }
         Row += BytesPerRow;
     }
 }
 
+// The pallet is padded to 256 colors, so every index gets looked up without checking it. Pallets of up to 16
+// colors get looked up with a shuffle per channel, larger ones with AVX2 gathers of eight colors.
 void
 Dereference8BitColorIndex(void *Source, void *Target, u32 *PalletData, u32 PalletSize,
                           u32 Width, u32 Height, u32 BytesPerRow)
 {
+    cpu_features Features = GetCPUFeatures();
+    b32 Shuffle = (Features.SSSE3 && PalletSize <= 16);
+    b32 Gather  = (Features.AVX2 && !Shuffle);
+    
+    // One byte of each of the first 16 colors for every channel. Larger indices get their high bit set, for
+    // which the shuffle returns 0.
+    __m128i ChannelBytes[4];
+    for(u32 Channel = 0; Channel < 4; Channel++)
+    {
+        u8 Bytes[16];
+        for(u32 Color = 0; Color < 16; Color++)
+        {
+            Bytes[Color] = (u8)(PalletData[Color] >> (Channel * 8));
+        }
+        ChannelBytes[Channel] = _mm_loadu_si128((__m128i *)Bytes);
+    }
+    __m128i LastColor = _mm_set1_epi8(15);
+    __m128i HighBit   = _mm_set1_epi8((char)0x80);
+    
     u32 *To = (u32 *)Target;
     u8 *Row = (u8 *)Source;
-    u32 LinesRemaining = Height;
-    while(LinesRemaining--)
+    for(u32 Y = 0; Y < Height; Y++)
     {
         u8 *From = Row;
-        u32 PixelsRemaining = Width;
-        while(PixelsRemaining--)
+        u32 X = 0;
+        if(Shuffle)
+        {
+            for(; X + 16 <= Width; X += 16)
+            {
+                __m128i Indices = _mm_loadu_si128((__m128i *)(From + X));
+                __m128i Inside  = _mm_cmpeq_epi8(_mm_min_epu8(Indices, LastColor), Indices);
+                Indices = _mm_or_si128(Indices, _mm_andnot_si128(Inside, HighBit));
+                __m128i Red   = _mm_shuffle_epi8(ChannelBytes[0], Indices);
+                __m128i Green = _mm_shuffle_epi8(ChannelBytes[1], Indices);
+                __m128i Blue  = _mm_shuffle_epi8(ChannelBytes[2], Indices);
+                __m128i Alpha = _mm_shuffle_epi8(ChannelBytes[3], Indices);
+                __m128i RedGreenLow   = _mm_unpacklo_epi8(Red, Green);
+                __m128i RedGreenHigh  = _mm_unpackhi_epi8(Red, Green);
+                __m128i BlueAlphaLow  = _mm_unpacklo_epi8(Blue, Alpha);
+                __m128i BlueAlphaHigh = _mm_unpackhi_epi8(Blue, Alpha);
+                _mm_storeu_si128((__m128i *)(To + X +  0), _mm_unpacklo_epi16(RedGreenLow,  BlueAlphaLow));
+                _mm_storeu_si128((__m128i *)(To + X +  4), _mm_unpackhi_epi16(RedGreenLow,  BlueAlphaLow));
+                _mm_storeu_si128((__m128i *)(To + X +  8), _mm_unpacklo_epi16(RedGreenHigh, BlueAlphaHigh));
+                _mm_storeu_si128((__m128i *)(To + X + 12), _mm_unpackhi_epi16(RedGreenHigh, BlueAlphaHigh));
+            }
+        }
+        else if(Gather)
         {
-            if(*From < PalletSize)
+            for(; X + 8 <= Width; X += 8)
             {
-                *(To++) = PalletData[*From];
+                __m256i Indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(From + X)));
+                _mm256_storeu_si256((__m256i *)(To + X), _mm256_i32gather_epi32((int *)PalletData, Indices, 4));
             }
-            From++;
         }
+        for(; X < Width; X++)
+        {
+            To[X] = PalletData[From[X]];
+        }
+        To += Width;
         Row += BytesPerRow;
     }
+    if(Gather)
+    {
+        _mm256_zeroupper();
+    }
 }
 
 void
@@ -109,8 +402,9 @@ DereferenceColorIndex(void *Source, void *Target, u32 *PalletData, u32 PalletSiz
     }
     else if(BitsPerPixel == 4 || BitsPerPixel == 2 || BitsPerPixel == 1)
     {
-        DereferenceColorIndexByte(Source, Target, PalletData, PalletSize,
-                                  Width, Height, BytesPerRow, (u8)BitsPerPixel);
+        u32 ByteColors[256 * 8];
+        BuildByteColors(ByteColors, PalletData, PalletSize, (u8)BitsPerPixel);
+        ExpandPixelBytes(Source, Target, ByteColors, 0, Width, Height, BytesPerRow, (u8)BitsPerPixel);
     }
     else
     {
@@ -123,12 +417,12 @@ void
 RearrangeChannelsBitsToU32(void *Source, void *Target,
                            u8   RedMask, u8   GreenMask, u8   BlueMask, u8   AlphaMask, 
                            u8 RedOffset, u8 GreenOffset, u8 BlueOffset, u8 AlphaOffset,
-                           u32 Width, u32 Height, u32 BytesPerRow, u8 BitsPerPixel)
+                           u32 Width, u32 Height, u32 BytesPerRow, u8 BitsPerPixel, color_key Key)
 {
-    r32   RedFactor =   (RedMask)?((r32)U8Max / (r32)(RedMask   >>   RedOffset)):0;
-    r32 GreenFactor = (GreenMask)?((r32)U8Max / (r32)(GreenMask >> GreenOffset)):0;
-    r32  BlueFactor =  (BlueMask)?((r32)U8Max / (r32)(BlueMask  >>  BlueOffset)):0;
-    r32 AlphaFactor = (AlphaMask)?((r32)U8Max / (r32)(AlphaMask >> AlphaOffset)):0;
+    channel_scale   RedScale = GetChannelScale(RedMask);
+    channel_scale GreenScale = GetChannelScale(GreenMask);
+    channel_scale  BlueScale = GetChannelScale(BlueMask);
+    channel_scale AlphaScale = GetChannelScale(AlphaMask);
     u8 AlphaFill = (AlphaMask)?0:U8Max;
     
     u8 BitMask = (1 << BitsPerPixel) - 1;
@@ -157,10 +451,11 @@ RearrangeChannelsBitsToU32(void *Source, void *Target,
             u8 Blue  = (Pixel &  BlueMask) >>  BlueOffset;
             u8 Alpha = (Pixel & AlphaMask) >> AlphaOffset;
             
-            *(To++) = (u8)((r32)Red   *   RedFactor + 0.5);
-            *(To++) = (u8)((r32)Green * GreenFactor + 0.5);
-            *(To++) = (u8)((r32)Blue  *  BlueFactor + 0.5);
-            *(To++) = (u8)((r32)Alpha * AlphaFactor + 0.5) + AlphaFill;
+            *(To++) = ScaleChannelToU8(Red,     RedScale);
+            *(To++) = ScaleChannelToU8(Green, GreenScale);
+            *(To++) = ScaleChannelToU8(Blue,   BlueScale);
+            u8 Opacity = ((Pixel & Key.Mask) == Key.Value) ? (u8)0 : U8Max;
+            *(To++) = (u8)((ScaleChannelToU8(Alpha, AlphaScale) + AlphaFill) & Opacity);
         }
         Row += BytesPerRow;
     }
@@ -170,21 +465,39 @@ void
 RearrangeChannelsBytesToU32(void *Source, void *Target,
                             u64  RedMask, u64  GreenMask, u64  BlueMask, u64  AlphaMask, 
                             u8 RedOffset, u8 GreenOffset, u8 BlueOffset, u8 AlphaOffset,
-                            u32 Width, u32 Height, u32 BytesPerRow, u8 BytesPerPixel)
+                            u32 Width, u32 Height, u32 BytesPerRow, u8 BytesPerPixel, color_key Key)
 {
-    r32   RedFactor =   (RedMask)?((r32)U8Max / (r32)(RedMask   >>   RedOffset)):0;
-    r32 GreenFactor = (GreenMask)?((r32)U8Max / (r32)(GreenMask >> GreenOffset)):0;
-    r32  BlueFactor =  (BlueMask)?((r32)U8Max / (r32)(BlueMask  >>  BlueOffset)):0;
-    r32 AlphaFactor = (AlphaMask)?((r32)U8Max / (r32)(AlphaMask >> AlphaOffset)):0;
+    channel_scale   RedScale = GetChannelScale(RedMask);
+    channel_scale GreenScale = GetChannelScale(GreenMask);
+    channel_scale  BlueScale = GetChannelScale(BlueMask);
+    channel_scale AlphaScale = GetChannelScale(AlphaMask);
     u8 AlphaFill = (AlphaMask)?0:U8Max;
     
+    // Pixels of up to 4 bytes get converted four at a time.
+    channel_lanes Lanes[4];
+    b32 FitsLanes = (FillChannelLanes(Lanes + 0, RedMask)  & FillChannelLanes(Lanes + 1, GreenMask) &
+                     FillChannelLanes(Lanes + 2, BlueMask) & FillChannelLanes(Lanes + 3, AlphaMask));
+    u32 LaneWidth = (FitsLanes && BytesPerPixel <= 4) ? (Width & ~3u) : 0;
+    __m128i AlphaLaneFill = _mm_set1_epi32((s32)((u32)AlphaFill << 24));
+    __m128i KeyMask  = _mm_set1_epi32((s32)Key.Mask);
+    __m128i KeyValue = _mm_set1_epi32((s32)Key.Value);
+    
     u8 *To  = (u8 *)Target;
     u8 *Row = (u8 *)Source;
     u32 LinesRemaining = Height;
     while(LinesRemaining--)
     {
         u8 *From = Row;
-        u32 PixelsRemaining = Width;
+        for(u32 X = 0; X < LaneWidth; X += 4)
+        {
+            __m128i Pixels = _mm_setr_epi32(*(s32 *)From, *(s32 *)(From + BytesPerPixel),
+                                            *(s32 *)(From + 2 * BytesPerPixel), *(s32 *)(From + 3 * BytesPerPixel));
+            _mm_storeu_si128((__m128i *)To, RearrangeChannelLanesToU32(Pixels, Lanes, AlphaLaneFill,
+                                                                       KeyMask, KeyValue));
+            From += 4 * BytesPerPixel;
+            To += 16;
+        }
+        u32 PixelsRemaining = Width - LaneWidth;
         while(PixelsRemaining--)
         {
             u64 Pixel = *(u64 *)From;
@@ -193,35 +506,59 @@ RearrangeChannelsBytesToU32(void *Source, void *Target,
             u64 Blue  = (Pixel &  BlueMask) >>  BlueOffset;
             u64 Alpha = (Pixel & AlphaMask) >> AlphaOffset;
             
-            *(To++) = (u8)((r32)Red   *   RedFactor + 0.5);
-            *(To++) = (u8)((r32)Green * GreenFactor + 0.5);
-            *(To++) = (u8)((r32)Blue  *  BlueFactor + 0.5);
-            *(To++) = (u8)((r32)Alpha * AlphaFactor + 0.5) + AlphaFill;
+            *(To++) = ScaleChannelToU8(Red,     RedScale);
+            *(To++) = ScaleChannelToU8(Green, GreenScale);
+            *(To++) = ScaleChannelToU8(Blue,   BlueScale);
+            u8 Opacity = ((Pixel & Key.Mask) == Key.Value) ? (u8)0 : U8Max;
+            *(To++) = (u8)((ScaleChannelToU8(Alpha, AlphaScale) + AlphaFill) & Opacity);
             From += BytesPerPixel;
         }
         Row += BytesPerRow;
     }
 }
 
+// The masks are those of the swapped 8 bytes starting at the pixel.
 void
 RearrangeChannelsBigEndianBytesToU32(void *Source, void *Target,
                                      u64  RedMask, u64  GreenMask, u64  BlueMask, u64  AlphaMask, 
                                      u8 RedOffset, u8 GreenOffset, u8 BlueOffset, u8 AlphaOffset,
-                                     u32 Width, u32 Height, u32 BytesPerRow, u8 BytesPerPixel)
+                                     u32 Width, u32 Height, u32 BytesPerRow, u8 BytesPerPixel, color_key Key)
 {
-    r32   RedFactor =   (RedMask)?((r32)U8Max / (r32)(RedMask   >>   RedOffset)):0;
-    r32 GreenFactor = (GreenMask)?((r32)U8Max / (r32)(GreenMask >> GreenOffset)):0;
-    r32  BlueFactor =  (BlueMask)?((r32)U8Max / (r32)(BlueMask  >>  BlueOffset)):0;
-    r32 AlphaFactor = (AlphaMask)?((r32)U8Max / (r32)(AlphaMask >> AlphaOffset)):0;
+    channel_scale   RedScale = GetChannelScale(RedMask);
+    channel_scale GreenScale = GetChannelScale(GreenMask);
+    channel_scale  BlueScale = GetChannelScale(BlueMask);
+    channel_scale AlphaScale = GetChannelScale(AlphaMask);
     u8 AlphaFill = (AlphaMask)?0:U8Max;
     
+    // Pixels of up to 4 bytes only use the upper half of the swapped 8 bytes. Swapping just their 4 bytes puts
+    // that half into a 32 bit lane, so they get converted four at a time like the little endian ones.
+    channel_lanes Lanes[4];
+    b32 FitsLanes = (FillChannelLanes(Lanes + 0, RedMask >> 32)  & FillChannelLanes(Lanes + 1, GreenMask >> 32) &
+                     FillChannelLanes(Lanes + 2, BlueMask >> 32) & FillChannelLanes(Lanes + 3, AlphaMask >> 32));
+    b32 UpperHalf = (((RedMask | GreenMask | BlueMask | AlphaMask) & U32Max) == 0);
+    u32 LaneWidth = (FitsLanes && UpperHalf && BytesPerPixel <= 4 && GetCPUFeatures().SSSE3) ? (Width & ~3u) : 0;
+    __m128i SwapBytes = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m128i AlphaLaneFill = _mm_set1_epi32((s32)((u32)AlphaFill << 24));
+    __m128i KeyMask  = _mm_set1_epi32((s32)(Key.Mask >> 32));
+    __m128i KeyValue = _mm_set1_epi32((s32)((Key.Mask) ? (Key.Value >> 32) : 1));
+    
     u8 *To  = (u8 *)Target;
     u8 *Row = (u8 *)Source;
     u32 LinesRemaining = Height;
     while(LinesRemaining--)
     {
         u8 *From = Row;
-        u32 PixelsRemaining = Width;
+        for(u32 X = 0; X < LaneWidth; X += 4)
+        {
+            __m128i Pixels = _mm_setr_epi32(*(s32 *)From, *(s32 *)(From + BytesPerPixel),
+                                            *(s32 *)(From + 2 * BytesPerPixel), *(s32 *)(From + 3 * BytesPerPixel));
+            Pixels = _mm_shuffle_epi8(Pixels, SwapBytes);
+            _mm_storeu_si128((__m128i *)To, RearrangeChannelLanesToU32(Pixels, Lanes, AlphaLaneFill,
+                                                                       KeyMask, KeyValue));
+            From += 4 * BytesPerPixel;
+            To += 16;
+        }
+        u32 PixelsRemaining = Width - LaneWidth;
         while(PixelsRemaining--)
         {
             u64 Pixel = SwapEndian(*(u64 *)From);
@@ -230,38 +567,261 @@ RearrangeChannelsBigEndianBytesToU32(void *Source, void *Target,
             u64 Blue  = (Pixel &  BlueMask) >>  BlueOffset;
             u64 Alpha = (Pixel & AlphaMask) >> AlphaOffset;
             
-            *(To++) = (u8)((r32)Red   *   RedFactor + 0.5);
-            *(To++) = (u8)((r32)Green * GreenFactor + 0.5);
-            *(To++) = (u8)((r32)Blue  *  BlueFactor + 0.5);
-            *(To++) = (u8)((r32)Alpha * AlphaFactor + 0.5) + AlphaFill;
+            *(To++) = ScaleChannelToU8(Red,     RedScale);
+            *(To++) = ScaleChannelToU8(Green, GreenScale);
+            *(To++) = ScaleChannelToU8(Blue,   BlueScale);
+            u8 Opacity = ((Pixel & Key.Mask) == Key.Value) ? (u8)0 : U8Max;
+            *(To++) = (u8)((ScaleChannelToU8(Alpha, AlphaScale) + AlphaFill) & Opacity);
             From += BytesPerPixel;
         }
         Row += BytesPerRow;
     }
 }
 
+// For pixels whose channels each fill a whole byte, like RGB8 or BGRA8. Every shuffle moves the channels of
+// four pixels into place, so one load covers 4 to 16 pixels depending on their size.
+void
+ShuffleChannelBytesToU32(void *Source, void *Target, u8 *ChannelBytes,
+                           u32 Width, u32 Height, u32 BytesPerRow, u8 BytesPerPixel, color_key Key)
+{
+    // ChannelBytes holds the byte of each channel inside the pixel, 0x80 clears the output byte.
+    u32 AlphaBits = (ChannelBytes[3] == 0x80)?0xff000000:0;
+    __m128i AlphaFill = _mm_set1_epi32((s32)AlphaBits);
+    
+    // The shuffle only moves bytes around, so the key gets moved the same way and compared afterwards.
+    u32 KeyBits = 0;
+    u32 KeyValueBits = 1;
+    if(Key.Mask)
+    {
+        KeyValueBits = 0;
+        for(u32 Channel = 0; Channel < 4; Channel++)
+        {
+            if(ChannelBytes[Channel] != 0x80)
+            {
+                KeyBits |= 0xffu << (Channel * 8);
+                KeyValueBits |= (u32)((Key.Value >> (ChannelBytes[Channel] * 8)) & 0xff) << (Channel * 8);
+            }
+        }
+    }
+    __m128i KeyMask  = _mm_set1_epi32((s32)KeyBits);
+    __m128i KeyValue = _mm_set1_epi32((s32)KeyValueBits);
+    
+    u32 GroupSize = (16 / BytesPerPixel) & ~3u;
+    u32 ShuffleCount = GroupSize / 4;
+    __m128i Shuffles[4];
+    for(u32 ShuffleIndex = 0; ShuffleIndex < ShuffleCount; ShuffleIndex++)
+    {
+        u8 Bytes[16];
+        for(u32 Byte = 0; Byte < 16; Byte++)
+        {
+            u8 Entry = ChannelBytes[Byte % 4];
+            u32 Pixel = ShuffleIndex * 4 + Byte / 4;
+            Bytes[Byte] = (Entry == 0x80) ? Entry : (u8)(Entry + Pixel * BytesPerPixel);
+        }
+        Shuffles[ShuffleIndex] = _mm_loadu_si128((__m128i *)Bytes);
+    }
+    
+    u32 *To = (u32 *)Target;
+    u8 *Row = (u8 *)Source;
+    for(u32 Y = 0; Y < Height; Y++)
+    {
+        u8 *From = Row;
+        u32 X = 0;
+        // The loads stay inside the row.
+        for(; (u64)(Width - X) * BytesPerPixel >= 16; X += GroupSize)
+        {
+            __m128i Pixels = _mm_loadu_si128((__m128i *)From);
+            for(u32 ShuffleIndex = 0; ShuffleIndex < ShuffleCount; ShuffleIndex++)
+            {
+                __m128i Shuffled = _mm_shuffle_epi8(Pixels, Shuffles[ShuffleIndex]);
+                __m128i Keyed = _mm_cmpeq_epi32(_mm_and_si128(Shuffled, KeyMask), KeyValue);
+                __m128i Converted = _mm_andnot_si128(_mm_slli_epi32(Keyed, 24), _mm_or_si128(Shuffled, AlphaFill));
+                _mm_storeu_si128((__m128i *)(To + ShuffleIndex * 4), Converted);
+            }
+            From += GroupSize * BytesPerPixel;
+            To += GroupSize;
+        }
+        for(; X < Width; X++)
+        {
+            u8 *Entry = (u8 *)To;
+            for(u32 Byte = 0; Byte < 4; Byte++)
+            {
+                Entry[Byte] = (ChannelBytes[Byte] == 0x80) ? 0 : From[ChannelBytes[Byte]];
+            }
+            *To |= AlphaBits;
+            if((*To & KeyBits) == KeyValueBits)
+            {
+                *To &= 0xffffff;
+            }
+            To++;
+            From += BytesPerPixel;
+        }
+        Row += BytesPerRow;
+    }
+}
+
+constexpr u8
+MaskOffset(u64 Mask)
+{
+    return((Mask == 0 || (Mask & 1)) ? 0 : (u8)(1 + MaskOffset(Mask >> 1)));
+}
+
+// The generic conversion with the masks and shifts of one pixel format known at compile time.
+// The pixels get loaded at their own size instead of as 8 bytes.
+template<u64 RedMask, u64 GreenMask, u64 BlueMask, u64 AlphaMask, typename pixel>
+void
+RearrangePackedChannelsToU32(void *Source, void *Target, u32 Width, u32 Height, u32 BytesPerRow, color_key Key)
+{
+    const u8   RedOffset = MaskOffset(RedMask);
+    const u8 GreenOffset = MaskOffset(GreenMask);
+    const u8  BlueOffset = MaskOffset(BlueMask);
+    const u8 AlphaOffset = MaskOffset(AlphaMask);
+    channel_scale   RedScale = GetChannelScale(RedMask);
+    channel_scale GreenScale = GetChannelScale(GreenMask);
+    channel_scale  BlueScale = GetChannelScale(BlueMask);
+    channel_scale AlphaScale = GetChannelScale(AlphaMask);
+    const u8 AlphaFill = (AlphaMask)?0:U8Max;
+    
+    channel_lanes Lanes[4];
+    b32 FitsLanes = (FillChannelLanes(Lanes + 0, RedMask)  & FillChannelLanes(Lanes + 1, GreenMask) &
+                     FillChannelLanes(Lanes + 2, BlueMask) & FillChannelLanes(Lanes + 3, AlphaMask));
+    u32 LaneWidth = FitsLanes ? (Width & ~3u) : 0;
+    __m128i AlphaLaneFill = _mm_set1_epi32((s32)((u32)AlphaFill << 24));
+    __m128i KeyMask  = _mm_set1_epi32((s32)Key.Mask);
+    __m128i KeyValue = _mm_set1_epi32((s32)Key.Value);
+    
+    u8 *To  = (u8 *)Target;
+    u8 *Row = (u8 *)Source;
+    for(u32 Y = 0; Y < Height; Y++)
+    {
+        pixel *From = (pixel *)Row;
+        for(u32 X = 0; X < LaneWidth; X += 4)
+        {
+            __m128i Pixels = _mm_setr_epi32((s32)From[0], (s32)From[1], (s32)From[2], (s32)From[3]);
+            _mm_storeu_si128((__m128i *)To, RearrangeChannelLanesToU32(Pixels, Lanes, AlphaLaneFill,
+                                                                       KeyMask, KeyValue));
+            From += 4;
+            To += 16;
+        }
+        for(u32 X = LaneWidth; X < Width; X++)
+        {
+            u64 Pixel = *(From++);
+            u64 Red   = (Pixel &   RedMask) >>   RedOffset;
+            u64 Green = (Pixel & GreenMask) >> GreenOffset;
+            u64 Blue  = (Pixel &  BlueMask) >>  BlueOffset;
+            u64 Alpha = (Pixel & AlphaMask) >> AlphaOffset;
+            
+            *(To++) = ScaleChannelToU8(Red,     RedScale);
+            *(To++) = ScaleChannelToU8(Green, GreenScale);
+            *(To++) = ScaleChannelToU8(Blue,   BlueScale);
+            u8 Opacity = ((Pixel & Key.Mask) == Key.Value) ? (u8)0 : U8Max;
+            *(To++) = (u8)((ScaleChannelToU8(Alpha, AlphaScale) + AlphaFill) & Opacity);
+        }
+        Row += BytesPerRow;
+    }
+}
+
+typedef void channel_rearrangement_kernel(void *Source, void *Target, u32 Width, u32 Height, u32 BytesPerRow,
+                                          color_key Key);
+
+struct channel_rearrangement
+{
+    u64 RedMask;
+    u64 GreenMask;
+    u64 BlueMask;
+    u64 AlphaMask;
+    u32 BytesPerPixel;
+    channel_rearrangement_kernel *Kernel;
+};
+
+#define PACKED_CHANNELS(Red, Green, Blue, Alpha, pixel) \
+    {Red, Green, Blue, Alpha, sizeof(pixel), RearrangePackedChannelsToU32<Red, Green, Blue, Alpha, pixel>}
+
+// The little endian formats of CHANNEL_MASK_MAP with channels that don't fill whole bytes, those with whole
+// bytes are shuffled instead.
+static channel_rearrangement CHANNEL_REARRANGEMENTS[] = {
+    // 1 byte
+    PACKED_CHANNELS(0x07, 0x38, 0xc0, 0x00, u8),
+    PACKED_CHANNELS(0xc0, 0x38, 0x07, 0x00, u8),
+    // 2 bytes
+    PACKED_CHANNELS(0x000f, 0x00f0, 0x0f00, 0xf000, u16),
+    PACKED_CHANNELS(0xf000, 0x0f00, 0x00f0, 0x000f, u16),
+    PACKED_CHANNELS(0x001f, 0x03e0, 0x7c00, 0x8000, u16),
+    PACKED_CHANNELS(0xf800, 0x07c0, 0x003e, 0x0001, u16),
+    PACKED_CHANNELS(0x001f, 0x07e0, 0xf800, 0x0000, u16),
+    PACKED_CHANNELS(0xf800, 0x07e0, 0x001f, 0x0000, u16),
+    PACKED_CHANNELS(0xffff, 0x0000, 0x0000, 0x0000, u16),
+    // 4 bytes
+    PACKED_CHANNELS(0x00000ffc, 0x003ff000, 0xffc00000, 0x00000003, u32),
+    PACKED_CHANNELS(0xffc00000, 0x003ff000, 0x00000ffc, 0x00000003, u32),
+    PACKED_CHANNELS(0x000003ff, 0x000ffc00, 0x3ff00000, 0xc0000000, u32),
+    PACKED_CHANNELS(0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000, u32),
+    PACKED_CHANNELS(0x0000ffff, 0xffff0000, 0x00000000, 0x00000000, u32),
+    PACKED_CHANNELS(0xffffffff, 0x00000000, 0x00000000, 0x00000000, u32),
+};
+
 void
 RearrangeChannelsToU32(void *Source, void *Target,
                        u64  RedMask, u64  GreenMask, u64  BlueMask, u64  AlphaMask, 
                        u8 RedOffset, u8 GreenOffset, u8 BlueOffset, u8 AlphaOffset,
                        u32 Width, u32 Height, u32 BytesPerRow,
-                       u32 BitsPerPixel, bool BigEndian)
+                       u32 BitsPerPixel, bool BigEndian, color_key Key)
 {
     if((BitsPerPixel & 7) == 0)
     {
-        if(BigEndian)
+        u8 BytesPerPixel = (u8)(BitsPerPixel / 8);
+        u64 Masks[4] = {RedMask, GreenMask, BlueMask, AlphaMask};
+        u8 Offsets[4] = {RedOffset, GreenOffset, BlueOffset, AlphaOffset};
+        
+        // Formats with a kernel of their own, or channels that fill whole bytes, skip the generic loop.
+        channel_rearrangement_kernel *Kernel = 0;
+        for(u32 Index = 0; Index < ArrayCount(CHANNEL_REARRANGEMENTS) && !BigEndian; Index++)
+        {
+            channel_rearrangement *Entry = CHANNEL_REARRANGEMENTS + Index;
+            if(Entry->BytesPerPixel == BytesPerPixel &&
+               Entry->RedMask  == RedMask  && Entry->GreenMask == GreenMask &&
+               Entry->BlueMask == BlueMask && Entry->AlphaMask == AlphaMask)
+            {
+                Kernel = Entry->Kernel;
+            }
+        }
+        b32 WholeBytes = (!BigEndian && BytesPerPixel <= 4 && GetCPUFeatures().SSSE3);
+        u8 ChannelBytes[4];
+        for(u32 Channel = 0; Channel < 4; Channel++)
+        {
+            ChannelBytes[Channel] = (u8)(Offsets[Channel] / 8);
+            if(!Masks[Channel])
+            {
+                ChannelBytes[Channel] = 0x80;
+            }
+            else if(Masks[Channel] != (0xffull << Offsets[Channel]) || Offsets[Channel] % 8 ||
+                    ChannelBytes[Channel] >= BytesPerPixel)
+            {
+                WholeBytes = false;
+            }
+        }
+        
+        if(Kernel)
+        {
+            Kernel(Source, Target, Width, Height, BytesPerRow, Key);
+        }
+        else if(WholeBytes)
+        {
+            ShuffleChannelBytesToU32(Source, Target, ChannelBytes, Width, Height, BytesPerRow, BytesPerPixel, Key);
+        }
+        else if(BigEndian)
         {
             RearrangeChannelsBigEndianBytesToU32(Source, Target,
                                                  RedMask,   GreenMask,   BlueMask,   AlphaMask, 
                                                  RedOffset, GreenOffset, BlueOffset, AlphaOffset,
-                                                 Width, Height, BytesPerRow, (u8)(BitsPerPixel / 8));
+                                                 Width, Height, BytesPerRow, BytesPerPixel, Key);
         }
         else
         {
             RearrangeChannelsBytesToU32(Source, Target,
                                         RedMask,   GreenMask,   BlueMask,   AlphaMask, 
                                         RedOffset, GreenOffset, BlueOffset, AlphaOffset,
-                                        Width, Height, BytesPerRow, (u8)(BitsPerPixel / 8));
+                                        Width, Height, BytesPerRow, BytesPerPixel, Key);
         }
     }
     else if(BitsPerPixel == 4 || BitsPerPixel == 2 || BitsPerPixel == 1)
@@ -269,11 +829,418 @@ RearrangeChannelsToU32(void *Source, void *Target,
         RearrangeChannelsBitsToU32(Source, Target,
                                    (u8)RedMask, (u8)GreenMask, (u8)BlueMask, (u8)AlphaMask, 
                                    RedOffset,   GreenOffset,   BlueOffset,   AlphaOffset,
-                                   Width, Height, BytesPerRow, (u8)BitsPerPixel);
+                                   Width, Height, BytesPerRow, (u8)BitsPerPixel, Key);
     }
     else
     {
         // TODO(Zyonji): Implement color channel decoders that aren't byte aligned.
         LogError("The image uses an unsupported byte unaligned pixel format.", "Image Decoder");
     }
-}
\ No newline at end of file
+}
+// Stretches a channel to 16 bits with integers, 16 bit channels stay as they are.
+inline u64
+ScaleChannelToU16(u64 Value, u64 Maximum)
+{
+    if(Maximum == U16Max || Maximum == 0)
+    {
+        return(Value);
+    }
+    return((Value * U16Max + Maximum / 2) / Maximum);
+}
+
+// Channels that aren't exactly 16 bits get stretched one pixel at a time.
+void
+RearrangeChannelsBytesToU64(void *Source, void *Target,
+                            u64  RedMask, u64  GreenMask, u64  BlueMask, u64  AlphaMask, 
+                            u8 RedOffset, u8 GreenOffset, u8 BlueOffset, u8 AlphaOffset,
+                            u32 Width, u32 Height, u32 BytesPerRow, u8 BytesPerPixel, bool BigEndian,
+                            color_key Key)
+{
+    u64   RedMaximum =   RedMask >>   RedOffset;
+    u64 GreenMaximum = GreenMask >> GreenOffset;
+    u64  BlueMaximum =  BlueMask >>  BlueOffset;
+    u64 AlphaMaximum = AlphaMask >> AlphaOffset;
+    u64 AlphaFill = (AlphaMask)?0:((u64)U16Max << 48);
+    
+    u64 *To = (u64 *)Target;
+    u8 *Row = (u8 *)Source;
+    u32 LinesRemaining = Height;
+    while(LinesRemaining--)
+    {
+        u8 *From = Row;
+        u32 PixelsRemaining = Width;
+        while(PixelsRemaining--)
+        {
+            u64 Pixel = *(u64 *)From;
+            if(BigEndian)
+            {
+                Pixel = SwapEndian(Pixel);
+            }
+            u64 Red   = ScaleChannelToU16((Pixel &   RedMask) >>   RedOffset,   RedMaximum);
+            u64 Green = ScaleChannelToU16((Pixel & GreenMask) >> GreenOffset, GreenMaximum);
+            u64 Blue  = ScaleChannelToU16((Pixel &  BlueMask) >>  BlueOffset,  BlueMaximum);
+            u64 Alpha = ScaleChannelToU16((Pixel & AlphaMask) >> AlphaOffset, AlphaMaximum);
+            
+            u64 Opacity = ((Pixel & Key.Mask) == Key.Value) ? 0x0000ffffffffffff : U64Max;
+            *(To++) = (Red | (Green << 16) | (Blue << 32) | (Alpha << 48) | AlphaFill) & Opacity;
+            From += BytesPerPixel;
+        }
+        Row += BytesPerRow;
+    }
+}
+
+// For pixels made of 16 bit channels, big endian as PNG stores them or little endian. Every shuffle moves the
+// channels of two pixels into place, swapping their bytes if needed, so one load covers 2 to 8 pixels depending
+// on their size.
+void
+RearrangeChannelShortsToU64(void *Source, void *Target, channel_location *Locations,
+                            u32 Width, u32 Height, u32 BytesPerRow, u8 BytesPerPixel, bool BigEndian, color_key Key)
+{
+    // Big endian channels are located in the swapped 8 bytes starting at the pixel, 0x80 clears the output byte.
+    u8 PixelShuffle[8];
+    for(u32 Channel = 0; Channel < 4; Channel++)
+    {
+        u8 LowByte  = (u8)(Locations[Channel].Offset / 8);
+        u8 HighByte = (u8)(LowByte + 1);
+        if(BigEndian)
+        {
+            LowByte  = (u8)(7 - LowByte);
+            HighByte = (u8)(LowByte - 1);
+        }
+        PixelShuffle[Channel * 2 + 0] = (Locations[Channel].BitCount) ? LowByte : 0x80;
+        PixelShuffle[Channel * 2 + 1] = (Locations[Channel].BitCount) ? HighByte : 0x80;
+    }
+    u64 AlphaBits = (Locations[3].BitCount)?0:((u64)U16Max << 48);
+    __m128i AlphaFill = _mm_set1_epi64x((s64)AlphaBits);
+    
+    // The 16 bit channels keep their values, so the key gets moved into place and compared afterwards.
+    u64 KeyBits = 0;
+    u64 KeyValueBits = 1;
+    if(Key.Mask)
+    {
+        KeyValueBits = 0;
+        for(u32 Channel = 0; Channel < 4; Channel++)
+        {
+            if(Locations[Channel].BitCount)
+            {
+                KeyBits |= (u64)U16Max << (Channel * 16);
+                KeyValueBits |= ((Key.Value >> Locations[Channel].Offset) & U16Max) << (Channel * 16);
+            }
+        }
+    }
+    __m128i KeyMask  = _mm_set1_epi64x((s64)KeyBits);
+    __m128i KeyValue = _mm_set1_epi64x((s64)KeyValueBits);
+    __m128i OpaqueBits = _mm_set1_epi64x((s64)((u64)U16Max << 48));
+    
+    u32 GroupSize = 16 / BytesPerPixel;
+    u32 ShuffleCount = GroupSize / 2;
+    __m128i Shuffles[4];
+    for(u32 ShuffleIndex = 0; ShuffleIndex < ShuffleCount; ShuffleIndex++)
+    {
+        u8 Bytes[16];
+        for(u32 Byte = 0; Byte < 16; Byte++)
+        {
+            u8 Entry = PixelShuffle[Byte % 8];
+            u32 Pixel = ShuffleIndex * 2 + Byte / 8;
+            Bytes[Byte] = (Entry == 0x80) ? Entry : (u8)(Entry + Pixel * BytesPerPixel);
+        }
+        Shuffles[ShuffleIndex] = _mm_loadu_si128((__m128i *)Bytes);
+    }
+    
+    u64 *To = (u64 *)Target;
+    u8 *Row = (u8 *)Source;
+    for(u32 Y = 0; Y < Height; Y++)
+    {
+        u8 *From = Row;
+        u32 X = 0;
+        // The loads stay inside the row.
+        for(; (u64)(Width - X) * BytesPerPixel >= 16; X += GroupSize)
+        {
+            __m128i Pixels = _mm_loadu_si128((__m128i *)From);
+            for(u32 ShuffleIndex = 0; ShuffleIndex < ShuffleCount; ShuffleIndex++)
+            {
+                __m128i Shuffled = _mm_shuffle_epi8(Pixels, Shuffles[ShuffleIndex]);
+                // Both halves of a pixel have to match.
+                __m128i Keyed = _mm_cmpeq_epi32(_mm_and_si128(Shuffled, KeyMask), KeyValue);
+                Keyed = _mm_and_si128(Keyed, _mm_shuffle_epi32(Keyed, _MM_SHUFFLE(2, 3, 0, 1)));
+                __m128i Converted = _mm_andnot_si128(_mm_and_si128(Keyed, OpaqueBits),
+                                                     _mm_or_si128(Shuffled, AlphaFill));
+                _mm_storeu_si128((__m128i *)(To + ShuffleIndex * 2), Converted);
+            }
+            From += GroupSize * BytesPerPixel;
+            To += GroupSize;
+        }
+        for(; X < Width; X++)
+        {
+            u8 *Entry = (u8 *)To;
+            for(u32 Byte = 0; Byte < 8; Byte++)
+            {
+                Entry[Byte] = (PixelShuffle[Byte] == 0x80) ? 0 : From[PixelShuffle[Byte]];
+            }
+            *To |= AlphaBits;
+            if((*To & KeyBits) == KeyValueBits)
+            {
+                *To &= 0x0000ffffffffffff;
+            }
+            To++;
+            From += BytesPerPixel;
+        }
+        Row += BytesPerRow;
+    }
+}
+
+// Only used for images with channels of more than 8 bits, which are never smaller than a byte per pixel.
+void
+RearrangeChannelsToU64(void *Source, void *Target,
+                       u64  RedMask, u64  GreenMask, u64  BlueMask, u64  AlphaMask, 
+                       channel_location *Locations,
+                       u32 Width, u32 Height, u32 BytesPerRow,
+                       u32 BitsPerPixel, bool BigEndian, color_key Key)
+{
+    if((BitsPerPixel & 7) == 0)
+    {
+        u8 BytesPerPixel = (u8)(BitsPerPixel / 8);
+        b32 Shorts = ((BytesPerPixel & 1) == 0 && GetCPUFeatures().SSSE3);
+        for(u32 Channel = 0; Channel < 4; Channel++)
+        {
+            // Big endian pixels sit in the upper bytes of their swapped masks, little endian ones in the lower.
+            u32 Offset = Locations[Channel].Offset;
+            b32 InsidePixel = (BigEndian) ? (Offset / 8 >= 8u - BytesPerPixel) : (Offset + 16 <= BytesPerPixel * 8u);
+            if(Locations[Channel].BitCount &&
+               (Locations[Channel].BitCount != 16 || Offset % 8 || Offset > 48 || !InsidePixel))
+            {
+                Shorts = false;
+            }
+        }
+        
+        if(Shorts)
+        {
+            RearrangeChannelShortsToU64(Source, Target, Locations,
+                                        Width, Height, BytesPerRow, BytesPerPixel, BigEndian, Key);
+        }
+        else
+        {
+            RearrangeChannelsBytesToU64(Source, Target,
+                                        RedMask, GreenMask, BlueMask, AlphaMask,
+                                        Locations[0].Offset, Locations[1].Offset,
+                                        Locations[2].Offset, Locations[3].Offset,
+                                        Width, Height, BytesPerRow, BytesPerPixel, BigEndian, Key);
+        }
+    }
+    else
+    {
+        LogError("The image uses an unsupported byte unaligned pixel format.", "Image Decoder");
+    }
+}
+
+// Converted pallets are padded to 256 colors, those past the end of the pallet stay transparent black. So the
+// pallet buffer has to hold as many colors as this returns.
+u32
+GetConversionPalletSize(u32 PalletSize)
+{
+    return((PalletSize == 0 || PalletSize > 256) ? PalletSize : 256);
+}
+
+// Converts the pallet once, so the image rows can be converted in any order. The transparent color gets compared
+// by the conversion kernels as they load the pixels.
+// Wide conversions produce 16 bit RGBA instead of 8 bit, unless the image uses a pallet.
+void
+PrepareConversion(image_conversion *Conversion, image_processor_tasks Processor, u32 *PalletBuffer, b32 Wide)
+{
+    if(Processor.BigEndian)
+    {
+        Processor.RedMask   = SwapEndian(Processor.RedMask);
+        Processor.GreenMask = SwapEndian(Processor.GreenMask);
+        Processor.BlueMask  = SwapEndian(Processor.BlueMask);
+        Processor.AlphaMask = SwapEndian(Processor.AlphaMask);
+    }
+    
+    Conversion->Processor     = Processor;
+    Conversion->RedLocation   = GetChannelLocation(Processor.RedMask);
+    Conversion->GreenLocation = GetChannelLocation(Processor.GreenMask);
+    Conversion->BlueLocation  = GetChannelLocation(Processor.BlueMask);
+    Conversion->AlphaLocation = GetChannelLocation(Processor.AlphaMask);
+    
+    // Expects the byte alignment to be a power of 2.
+    u32 BitMask = Processor.ByteAlignment - 1;
+    Conversion->BytesPerRow = ((Processor.BitsPerPixel * Processor.Width + 7) / 8 + BitMask) & (~BitMask);
+    Conversion->FirstColumn = 0;
+    Conversion->ColumnCount = Processor.Width;
+    Conversion->TargetBytesPerPixel = (Wide && !Processor.PalletSize) ? 8 : 4;
+    Conversion->PalletData = PalletBuffer;
+    Conversion->Key = NO_COLOR_KEY;
+    
+    if(Processor.PalletSize)
+    {
+        RearrangeChannelsToU32(Processor.PalletData, PalletBuffer,
+                               Processor.RedMask,  Processor.GreenMask,
+                               Processor.BlueMask, Processor.AlphaMask, 
+                               Conversion->RedLocation.Offset,  Conversion->GreenLocation.Offset,
+                               Conversion->BlueLocation.Offset, Conversion->AlphaLocation.Offset,
+                               Processor.PalletSize, 1, 0, 
+                               Processor.BitsPerPalletColor, Processor.BigEndian, NO_COLOR_KEY);
+        for(u32 Index = Processor.PalletSize; Index < 256; Index++)
+        {
+            PalletBuffer[Index] = 0;
+        }
+    }
+    else
+    {
+        u64 ChannelMasks = Processor.RedMask | Processor.GreenMask | Processor.BlueMask | Processor.AlphaMask;
+        Conversion->Key = GetColorKey(Processor.TransparentColor, ChannelMasks,
+                                      Processor.BitsPerPixel, Processor.BigEndian);
+    }
+    
+    // Pixels smaller than a byte get expanded a byte at a time, from either the pallet or the colors of all
+    // their values.
+    u32 BitsPerPixel = Processor.BitsPerPixel;
+    if(BitsPerPixel == 4 || BitsPerPixel == 2 || BitsPerPixel == 1)
+    {
+        u32 ColorCount = 1 << BitsPerPixel;
+        u32 Colors[16] = {};
+        if(Processor.PalletSize)
+        {
+            for(u32 Index = 0; Index < ColorCount && Index < Processor.PalletSize; Index++)
+            {
+                Colors[Index] = PalletBuffer[Index];
+            }
+        }
+        else
+        {
+            // Every value packed into bytes the same way as the image rows.
+            u8 Values[8] = {};
+            for(u32 Value = 0; Value < ColorCount; Value++)
+            {
+                u32 Shift = 8 - BitsPerPixel * (Value % (8 / BitsPerPixel) + 1);
+                Values[Value * BitsPerPixel / 8] |= (u8)(Value << Shift);
+            }
+            RearrangeChannelsToU32(Values, Colors,
+                                   Processor.RedMask,  Processor.GreenMask,
+                                   Processor.BlueMask, Processor.AlphaMask, 
+                                   Conversion->RedLocation.Offset,  Conversion->GreenLocation.Offset,
+                                   Conversion->BlueLocation.Offset, Conversion->AlphaLocation.Offset,
+                                   ColorCount, 1, 0, BitsPerPixel, Processor.BigEndian, Conversion->Key);
+        }
+        BuildByteColors(Conversion->ByteColors, Colors, ColorCount, (u8)BitsPerPixel);
+    }
+}
+
+// Converts the given rows into 8 or 16 bit RGBA. Separate row ranges can be converted on separate threads.
+void
+ConvertRows(image_conversion *Conversion, void *Source, void *Target, u32 FirstRow, u32 RowCount)
+{
+    image_processor_tasks *Processor = &Conversion->Processor;
+    u32 BitsPerPixel = Processor->BitsPerPixel;
+    u32 Width = Conversion->ColumnCount;
+    u8 *From = (u8 *)Source + (u64)FirstRow * Conversion->BytesPerRow;
+    u8 *To   = (u8 *)Target + (u64)FirstRow * Width * Conversion->TargetBytesPerPixel;
+    
+    if(BitsPerPixel == 4 || BitsPerPixel == 2 || BitsPerPixel == 1)
+    {
+        ExpandPixelBytes(From, To, Conversion->ByteColors, Conversion->FirstColumn,
+                         Width, RowCount, Conversion->BytesPerRow, (u8)BitsPerPixel);
+    }
+    else if(Processor->PalletSize)
+    {
+        From += Conversion->FirstColumn;
+        DereferenceColorIndex(From, To, Conversion->PalletData, Processor->PalletSize,
+                              Width, RowCount, Conversion->BytesPerRow, BitsPerPixel);
+    }
+    else if(Conversion->TargetBytesPerPixel == 8)
+    {
+        channel_location Locations[4] = {Conversion->RedLocation,  Conversion->GreenLocation,
+                                         Conversion->BlueLocation, Conversion->AlphaLocation};
+        From += (u64)Conversion->FirstColumn * (BitsPerPixel / 8);
+        RearrangeChannelsToU64(From, To,
+                               Processor->RedMask,  Processor->GreenMask,
+                               Processor->BlueMask, Processor->AlphaMask,
+                               Locations, Width, RowCount, Conversion->BytesPerRow,
+                               BitsPerPixel, Processor->BigEndian, Conversion->Key);
+    }
+    else
+    {
+        From += (u64)Conversion->FirstColumn * (BitsPerPixel / 8);
+        RearrangeChannelsToU32(From, To,
+                               Processor->RedMask,  Processor->GreenMask,
+                               Processor->BlueMask, Processor->AlphaMask, 
+                               Conversion->RedLocation.Offset,  Conversion->GreenLocation.Offset,
+                               Conversion->BlueLocation.Offset, Conversion->AlphaLocation.Offset,
+                               Width, RowCount, Conversion->BytesPerRow,
+                               BitsPerPixel, Processor->BigEndian, Conversion->Key);
+    }
+}
+
+// The work entry of a band.
+void
+ConvertBand(void *Data)
+{
+    conversion_band *Band = (conversion_band *)Data;
+    if(Band->RowsDone)
+    {
+        // Sleeps instead of keeping a worker busy, the rows come in at the pace of the inflate.
+        WaitForCounter(Band->RowsDone, Band->FirstRow + Band->RowCount);
+    }
+    ConvertRows(Band->Conversion, Band->Source, Band->Target, Band->FirstRow, Band->RowCount);
+}
+
+// Splits the rows into bands for the work queue, a few per thread and none smaller than CONVERSION_BAND_PIXELS.
+// Returns the number of bands, 1 if the rows aren't worth splitting. Bands with RowsDone wait for the decoder.
+u32
+SplitConversionBands(conversion_band *Bands, image_conversion *Conversion, void *Source, void *Target,
+                     u32 FirstRow, u32 RowCount, u64 volatile *RowsDone)
+{
+    // A few bands per thread, so threads that start late still get their share.
+    u32 BandCount = (WorkerThreadCount() + 1) * 4;
+    u64 PixelBands = (u64)RowCount * Conversion->ColumnCount / CONVERSION_BAND_PIXELS;
+    if(BandCount > CONVERSION_BANDS)
+    {
+        BandCount = CONVERSION_BANDS;
+    }
+    if(BandCount > PixelBands)
+    {
+        BandCount = (u32)PixelBands;
+    }
+    if(WorkerThreadCount() == 0 || BandCount == 0)
+    {
+        BandCount = 1;
+    }
+    
+    u32 RowsPerBand = (RowCount + BandCount - 1) / BandCount;
+    u32 EndRow = FirstRow + RowCount;
+    u32 BandIndex = 0;
+    do
+    {
+        conversion_band *Band = Bands + BandIndex++;
+        Band->Conversion = Conversion;
+        Band->Source     = Source;
+        Band->Target     = Target;
+        Band->FirstRow   = FirstRow;
+        Band->RowCount   = EndRow - FirstRow;
+        Band->RowsDone   = RowsDone;
+        if(Band->RowCount > RowsPerBand)
+        {
+            Band->RowCount = RowsPerBand;
+        }
+        FirstRow += Band->RowCount;
+    } while(BandIndex < BandCount && FirstRow < EndRow);
+    return(BandIndex);
+}
+
+// The calling thread helps out until the bands are done. Every row gets converted on its own, so the result is the
+// same as from a single ConvertRows. Must not be called from inside a work entry.
+void
+ConvertRowsInBands(image_conversion *Conversion, void *Source, void *Target, u32 FirstRow, u32 RowCount)
+{
+    conversion_band Bands[CONVERSION_BANDS];
+    u32 BandCount = SplitConversionBands(Bands, Conversion, Source, Target, FirstRow, RowCount, 0);
+    if(BandCount < 2)
+    {
+        ConvertRows(Conversion, Source, Target, FirstRow, RowCount);
+        return;
+    }
+    for(u32 BandIndex = 0; BandIndex < BandCount; BandIndex++)
+    {
+        AddWorkEntry(ConvertBand, Bands + BandIndex);
+    }
+    CompleteAllWork();
+}
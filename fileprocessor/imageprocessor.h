@@ -28,8 +28,83 @@ struct image_processor_tasks
     u32 ColorSpace;
 };
 
+// A rectangle of the image, for decoding only part of it.
+struct image_region
+{
+    u32 X;
+    u32 Y;
+    u32 Width;
+    u32 Height;
+};
+
+// What decoding an image takes, read from its headers without touching the pixels.
+struct image_probe
+{
+    image_processor_tasks Processor;// Of the image as it gets stored, without the pallet data.
+    b32 Interlaced;// Adam7 interlaced PNG or progressive JPEG.
+    u32 FrameCount;
+    u64 BufferSize;// Requested with RequestImageBuffer, scratch memory and stored image together.
+    u64 OutputSize;// Of the image handed to StoreImage or StoreAnimationFrame.
+};
+
 struct channel_location
 {
     u8 BitCount;
     u8 Offset;
-};
\ No newline at end of file
+};
+
+// Rescales a channel to 8 bits as (Value * Multiplier + Add) >> Shift. Channels wider than 8 bits use the
+// same to divide by their maximum, see ScaleChannelToU8.
+struct channel_scale
+{
+    u32 Multiplier;
+    u64 Add;
+    u32 Shift;
+    u32 BitCount;
+};
+
+// The transparent color as the conversion kernels load the pixel, before any scaling. Pixels with
+// (Pixel & Mask) == Value lose their alpha. Without a transparent color nothing matches.
+struct color_key
+{
+    u64 Mask;
+    u64 Value;
+};
+
+struct image_conversion
+{
+    image_processor_tasks Processor;// The channel masks are already swapped for big endian data.
+    channel_location RedLocation;
+    channel_location GreenLocation;
+    channel_location BlueLocation;
+    channel_location AlphaLocation;
+    u32 BytesPerRow;
+    u32 FirstColumn;// Only the columns from FirstColumn on get converted, ColumnCount per row.
+    u32 ColumnCount;
+    u32 TargetBytesPerPixel;// 4 for 8 bit RGBA, 8 for 16 bit RGBA.
+    color_key Key;
+    u32 *PalletData;
+    u32 ByteColors[256 * 8];// The colors of every byte of 1, 2 or 4 bit pixels.
+};
+
+#define CONVERSION_BANDS 64
+#define CONVERSION_BAND_PIXELS (1 << 16)// Smaller bands aren't worth handing to another thread.
+
+struct conversion_band
+{
+    image_conversion *Conversion;
+    void *Source;
+    void *Target;
+    u32 FirstRow;
+    u32 RowCount;
+    u64 volatile *RowsDone;// If set, the band waits until the rows above this count are decoded.
+};
+// Work entries get picked up by the platform's worker threads in the order they were added.
+typedef void platform_work_callback(void *Data);
+
+struct cpu_features
+{
+    b32 PCLMUL;
+    b32 SSSE3;
+    b32 AVX2;
+};
@@ -742,7 +742,7 @@ DecodeImageData(u8 *ScanStart, void *FileEndpoint,void *ImageBuffer,
 }
 
 b32
-JPEG_Reader(void *FileMemory, void *FileEndpoint)
+JPEG_Reader(void *FileMemory, void *FileEndpoint, image_probe *Probe)
 {
     u8 *At = (u8 *)FileMemory;
     if(At + 4 >= FileEndpoint || *(At++) != 0xff || *(At++) != JPEG_SOI || *(At++) != 0xff)
@@ -861,7 +861,13 @@ JPEG_Reader(void *FileMemory, void *FileEndpoint)
     u64 ImageBufferSize    = (u64)Processor.DCTWidth * (u64)Processor.DCTHeight * sizeof(r32) * 4;
     u64 CombinedBufferSize = ImageBufferSize + sizeof(jpeg_decoder_buffers);
     
-    
+    if(Probe)
+    {
+        b32 Progressive = (*Marker == JPEG_SOF2 || *Marker == JPEG_SOF6 ||
+                           *Marker == JPEG_SOF10 || *Marker == JPEG_SOF14);
+        SetImageProbe(Probe, Processor, Progressive, 1, CombinedBufferSize, ImageBufferSize);
+        return(true);
+    }
     
     void *Buffer = RequestImageBuffer(CombinedBufferSize);
     
@@ -1,5 +1,15 @@
 #include "png.h"
 
+static b32 VerifyChecksums = PNG_VERIFY_CHECKSUMS;
+static b32 ProgressivePreview = PNG_PROGRESSIVE_PREVIEW;
+static u32 CRC32Table[16][256];
+static b32 CRC32TableReady;
+static deflate_code FixedLiteralDictionary[1 << DEFLATE_LITERAL_ROOT_BITS];
+static deflate_code FixedDistanceDictionary[1 << DEFLATE_DISTANCE_ROOT_BITS];
+static b32 FixedDictionariesReady;
+static u64 InterlaceSpread[3][6][256];// Per bit depth of 1, 2 and 4 and per pass but the last.
+static b32 InterlaceSpreadReady;
+
 static void
 AddAlphaToPallet(void *NewPallet, void *OldPallet, u32 PalletSize, void *AlphaData, u32 AlphaSize)
 {
@@ -17,43 +27,449 @@ AddAlphaToPallet(void *NewPallet, void *OldPallet, u32 PalletSize, void *AlphaDa
     }
 }
 
+// Indexes the run of IDAT or fdAT chunks starting at Chunk.
+static u32
+IndexDataSpans(png_chunk *Chunk, void *FileEndpoint, png_data_span *Spans, u32 ChunkType, u64 *DataSize)
+{
+    u32 HeaderSize = (ChunkType == PNG_fdAT) ? 4 : 0;// The sequence number.
+    u32 SpanCount = 0;
+    while(Chunk + 1 <= FileEndpoint && Chunk->TypeU32 == ChunkType)
+    {
+        u32 Length = SwapEndian(Chunk->Length);
+        u8 *DataEnd = Chunk->Data + Length;
+        if(DataEnd > FileEndpoint)
+        {
+            DataEnd = (u8 *)FileEndpoint;
+        }
+        if(Length > HeaderSize && Chunk->Data + HeaderSize < DataEnd)
+        {
+            if(Spans)
+            {
+                Spans[SpanCount].Chunk = Chunk;
+                Spans[SpanCount].Start = Chunk->Data + HeaderSize;
+                Spans[SpanCount].End   = DataEnd;
+            }
+            if(DataSize)
+            {
+                *DataSize += (u64)(DataEnd - (Chunk->Data + HeaderSize));
+            }
+            SpanCount++;
+        }
+        Chunk = (png_chunk *)(Chunk->OffsetBase + Length);
+    }
+    return(SpanCount);
+}
+
+// Slicing by 16 uses one table for each byte position in a block of 16 bytes.
+static void
+InitializeCRC32Table()
+{
+    if(CRC32TableReady)
+    {
+        return;
+    }
+    for(u32 Byte = 0; Byte < 256; Byte++)
+    {
+        u32 Value = Byte;
+        for(u32 Bit = 0; Bit < 8; Bit++)
+        {
+            Value = (Value >> 1) ^ (CRC32_POLYNOMIAL & (0 - (Value & 1)));
+        }
+        CRC32Table[0][Byte] = Value;
+    }
+    for(u32 Byte = 0; Byte < 256; Byte++)
+    {
+        for(u32 Slice = 1; Slice < 16; Slice++)
+        {
+            u32 Previous = CRC32Table[Slice - 1][Byte];
+            CRC32Table[Slice][Byte] = (Previous >> 8) ^ CRC32Table[0][Previous & 0xff];
+        }
+    }
+    CRC32TableReady = true;
+}
+
+static u32
+UpdateCRC32Slices(u32 CRC, u8 *At, u8 *End)// Takes and returns the inverted CRC.
+{
+    while(End - At >= 16)
+    {
+        u32 One   = CRC ^ *(u32 *)(At + 0);
+        u32 Two   = *(u32 *)(At + 4);
+        u32 Three = *(u32 *)(At + 8);
+        u32 Four  = *(u32 *)(At + 12);
+        CRC = (CRC32Table[15][One   & 0xff] ^ CRC32Table[14][(One   >> 8) & 0xff] ^
+               CRC32Table[13][(One   >> 16) & 0xff] ^ CRC32Table[12][One   >> 24] ^
+               CRC32Table[11][Two   & 0xff] ^ CRC32Table[10][(Two   >> 8) & 0xff] ^
+               CRC32Table[ 9][(Two   >> 16) & 0xff] ^ CRC32Table[ 8][Two   >> 24] ^
+               CRC32Table[ 7][Three & 0xff] ^ CRC32Table[ 6][(Three >> 8) & 0xff] ^
+               CRC32Table[ 5][(Three >> 16) & 0xff] ^ CRC32Table[ 4][Three >> 24] ^
+               CRC32Table[ 3][Four  & 0xff] ^ CRC32Table[ 2][(Four  >> 8) & 0xff] ^
+               CRC32Table[ 1][(Four  >> 16) & 0xff] ^ CRC32Table[ 0][Four  >> 24]);
+        At += 16;
+    }
+    while(At < End)
+    {
+        CRC = (CRC >> 8) ^ CRC32Table[0][(CRC ^ *(At++)) & 0xff];
+    }
+    return(CRC);
+}
+
+// Folds four 128 bit lanes over the data with carry-less multiplications, then reduces them to 32 bits.
+// The constants are powers of x modulo the polynomial, from Intel's paper "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction". Expects a multiple of 16 bytes, at least 64.
+static u32
+UpdateCRC32Folded(u32 CRC, u8 *At, u64 Length)// Takes and returns the inverted CRC.
+{
+    __m128i Lane1 = _mm_loadu_si128((__m128i *)(At + 0));
+    __m128i Lane2 = _mm_loadu_si128((__m128i *)(At + 16));
+    __m128i Lane3 = _mm_loadu_si128((__m128i *)(At + 32));
+    __m128i Lane4 = _mm_loadu_si128((__m128i *)(At + 48));
+    Lane1 = _mm_xor_si128(Lane1, _mm_cvtsi32_si128((s32)CRC));
+    At += 64;
+    Length -= 64;
+    
+    __m128i Fold4 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    while(Length >= 64)
+    {
+        __m128i Low1 = _mm_clmulepi64_si128(Lane1, Fold4, 0x00);
+        __m128i Low2 = _mm_clmulepi64_si128(Lane2, Fold4, 0x00);
+        __m128i Low3 = _mm_clmulepi64_si128(Lane3, Fold4, 0x00);
+        __m128i Low4 = _mm_clmulepi64_si128(Lane4, Fold4, 0x00);
+        Lane1 = _mm_clmulepi64_si128(Lane1, Fold4, 0x11);
+        Lane2 = _mm_clmulepi64_si128(Lane2, Fold4, 0x11);
+        Lane3 = _mm_clmulepi64_si128(Lane3, Fold4, 0x11);
+        Lane4 = _mm_clmulepi64_si128(Lane4, Fold4, 0x11);
+        Lane1 = _mm_xor_si128(_mm_xor_si128(Lane1, Low1), _mm_loadu_si128((__m128i *)(At + 0)));
+        Lane2 = _mm_xor_si128(_mm_xor_si128(Lane2, Low2), _mm_loadu_si128((__m128i *)(At + 16)));
+        Lane3 = _mm_xor_si128(_mm_xor_si128(Lane3, Low3), _mm_loadu_si128((__m128i *)(At + 32)));
+        Lane4 = _mm_xor_si128(_mm_xor_si128(Lane4, Low4), _mm_loadu_si128((__m128i *)(At + 48)));
+        At += 64;
+        Length -= 64;
+    }
+    
+    __m128i Fold1 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    __m128i Low = _mm_clmulepi64_si128(Lane1, Fold1, 0x00);
+    Lane1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(Lane1, Fold1, 0x11), Low), Lane2);
+    Low = _mm_clmulepi64_si128(Lane1, Fold1, 0x00);
+    Lane1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(Lane1, Fold1, 0x11), Low), Lane3);
+    Low = _mm_clmulepi64_si128(Lane1, Fold1, 0x00);
+    Lane1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(Lane1, Fold1, 0x11), Low), Lane4);
+    while(Length >= 16)
+    {
+        Low = _mm_clmulepi64_si128(Lane1, Fold1, 0x00);
+        Lane1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(Lane1, Fold1, 0x11), Low),
+                              _mm_loadu_si128((__m128i *)At));
+        At += 16;
+        Length -= 16;
+    }
+    
+    // 128 to 64 bits.
+    __m128i Mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+    Lane1 = _mm_xor_si128(_mm_srli_si128(Lane1, 8), _mm_clmulepi64_si128(Lane1, Fold1, 0x10));
+    __m128i High = _mm_srli_si128(Lane1, 4);
+    Lane1 = _mm_clmulepi64_si128(_mm_and_si128(Lane1, Mask32), _mm_set_epi64x(0, 0x0163cd6124), 0x00);
+    Lane1 = _mm_xor_si128(Lane1, High);
+    
+    // Barrett reduction to 32 bits.
+    __m128i Polynomial = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    __m128i Quotient = _mm_clmulepi64_si128(_mm_and_si128(Lane1, Mask32), Polynomial, 0x10);
+    Quotient = _mm_clmulepi64_si128(_mm_and_si128(Quotient, Mask32), Polynomial, 0x00);
+    Lane1 = _mm_xor_si128(Lane1, Quotient);
+    return((u32)_mm_cvtsi128_si32(_mm_srli_si128(Lane1, 4)));
+}
+
+static u32
+UpdateCRC32(u32 CRC, u8 *At, u64 Length)// Takes and returns the inverted CRC.
+{
+    InitializeCRC32Table();
+    if(Length >= 64 && GetCPUFeatures().PCLMUL)
+    {
+        u64 FoldLength = Length & ~(u64)15;
+        CRC = UpdateCRC32Folded(CRC, At, FoldLength);
+        At += FoldLength;
+        Length -= FoldLength;
+    }
+    return(UpdateCRC32Slices(CRC, At, At + Length));
+}
+
+// A chunk without room for its CRC inside the file counts as corrupt.
 static b32
-AdvanceDataChunk(png_bit_reader *Reader)
+ChunkCRCMatches(png_chunk *Chunk, void *FileEndpoint, u32 CRC)
 {
-    u8 *NewSegment = Reader->SegmentEnd + 12;
-    if(NewSegment < Reader->FileEnd)
+    u32 Length = SwapEndian(Chunk->Length);
+    if(Chunk->OffsetBase + Length > FileEndpoint)
     {
-        u32 SegmentLenght = SwapEndian(*(u32 *)(Reader->SegmentEnd + 4));
-        Reader->NextByte = NewSegment;
-        Reader->SegmentEnd = NewSegment + SegmentLenght;
-        
-        return(true);
+        return(false);
     }
-    return(false);
+    return(SwapEndian(*(u32 *)(Chunk->Data + Length)) == CRC);
+}
+
+static b32
+ChunkCRCMatches(png_chunk *Chunk, void *FileEndpoint)
+{
+    u32 Length = SwapEndian(Chunk->Length);
+    return(Chunk->OffsetBase + Length <= FileEndpoint &&
+           ChunkCRCMatches(Chunk, FileEndpoint, ~UpdateCRC32(U32Max, (u8 *)Chunk->Type, 4 + (u64)Length)));
 }
+
+// Catches the CRCs of the spans up with the bytes the reader has loaded so far. With FinishSpan, the
+// span the reader is in gets completed as well.
 static void
-BufferBits(png_bit_reader *Reader, u32 RequiredBitNumber)
+UpdateSpanCRCs(png_bit_reader *Reader, b32 FinishSpan)
 {
-    while(Reader->StoredBits < RequiredBitNumber)
+    while(Reader->CheckedSpan < Reader->NextSpan)
     {
-        if(Reader->NextByte < Reader->SegmentEnd)
+        png_data_span *Span = Reader->CheckedSpan;
+        u8 *Until = (Span == Reader->NextSpan - 1 && !FinishSpan) ? Reader->NextByte : Span->End;
+        if(!Reader->CheckedByte)
         {
-            Reader->Buffer += ((u32)*(Reader->NextByte++)) << Reader->StoredBits;
-            Reader->StoredBits += 8;
+            Reader->CRC = UpdateCRC32(U32Max, (u8 *)Span->Chunk->Type, (u64)(Span->Start - (u8 *)Span->Chunk->Type));
+            Reader->CheckedByte = Span->Start;
         }
-        else
+        Reader->CRC = UpdateCRC32(Reader->CRC, Reader->CheckedByte, (u64)(Until - Reader->CheckedByte));
+        Reader->CheckedByte = Until;
+        if(Until < Span->End)
+        {
+            break;
+        }
+        Span->CRC = ~Reader->CRC;
+        Span->CRCComputed = true;
+        Reader->CheckedSpan++;
+        Reader->CheckedByte = 0;
+    }
+}
+
+// Sums 64 bytes per step with AVX2 and 32 with SSSE3: the first sum through sums of absolute differences
+// against zero, the second one through multiplications with the distance of every byte to the end of the step.
+static u32
+UpdateAdler32(u32 Adler, u8 *At, u64 Length)
+{
+    u32 Sum1 = Adler & 0xffff;
+    u32 Sum2 = Adler >> 16;
+    cpu_features Features = GetCPUFeatures();
+    
+    if(Features.AVX2 && Length >= 64)
+    {
+        __m256i Zero     = _mm256_setzero_si256();
+        __m256i Ones     = _mm256_set1_epi16(1);
+        __m256i Weights1 = _mm256_setr_epi8(64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49,
+                                            48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33);
+        __m256i Weights2 = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                            16, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1);
+        u64 Steps = Length / 64;
+        Length -= Steps * 64;
+        while(Steps)
+        {
+            u32 RunSteps = ADLER32_MAX_RUN / 64;
+            if(RunSteps > Steps)
+            {
+                RunSteps = (u32)Steps;
+            }
+            Steps -= RunSteps;
+            
+            // Every earlier first sum gets added to the second one 64 times per step.
+            __m256i Previous = _mm256_setr_epi32((s32)(Sum1 * RunSteps), 0, 0, 0, 0, 0, 0, 0);
+            __m256i First    = _mm256_setzero_si256();
+            __m256i Second   = _mm256_setr_epi32((s32)Sum2, 0, 0, 0, 0, 0, 0, 0);
+            while(RunSteps--)
+            {
+                __m256i Bytes1 = _mm256_loadu_si256((__m256i *)(At + 0));
+                __m256i Bytes2 = _mm256_loadu_si256((__m256i *)(At + 32));
+                Previous = _mm256_add_epi32(Previous, First);
+                First  = _mm256_add_epi32(First, _mm256_sad_epu8(Bytes1, Zero));
+                First  = _mm256_add_epi32(First, _mm256_sad_epu8(Bytes2, Zero));
+                Second = _mm256_add_epi32(Second, _mm256_madd_epi16(_mm256_maddubs_epi16(Bytes1, Weights1), Ones));
+                Second = _mm256_add_epi32(Second, _mm256_madd_epi16(_mm256_maddubs_epi16(Bytes2, Weights2), Ones));
+                At += 64;
+            }
+            Second = _mm256_add_epi32(Second, _mm256_slli_epi32(Previous, 6));
+            
+            __m128i First128  = _mm_add_epi32(_mm256_castsi256_si128(First), _mm256_extracti128_si256(First, 1));
+            __m128i Second128 = _mm_add_epi32(_mm256_castsi256_si128(Second), _mm256_extracti128_si256(Second, 1));
+            First128  = _mm_add_epi32(First128, _mm_shuffle_epi32(First128, 0x4e));
+            First128  = _mm_add_epi32(First128, _mm_shuffle_epi32(First128, 0xb1));
+            Second128 = _mm_add_epi32(Second128, _mm_shuffle_epi32(Second128, 0x4e));
+            Second128 = _mm_add_epi32(Second128, _mm_shuffle_epi32(Second128, 0xb1));
+            Sum1 = (Sum1 + (u32)_mm_cvtsi128_si32(First128)) % ADLER32_MODULO;
+            Sum2 = (u32)_mm_cvtsi128_si32(Second128) % ADLER32_MODULO;
+        }
+        _mm256_zeroupper();
+    }
+    
+    if(Features.SSSE3)
+    {
+        __m128i Zero    = _mm_setzero_si128();
+        __m128i Ones    = _mm_set1_epi16(1);
+        __m128i Weights1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+        __m128i Weights2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1);
+        u64 Steps = Length / 32;
+        Length -= Steps * 32;
+        while(Steps)
         {
-            if(!AdvanceDataChunk(Reader))
+            u32 RunSteps = ADLER32_MAX_RUN / 32;
+            if(RunSteps > Steps)
+            {
+                RunSteps = (u32)Steps;
+            }
+            Steps -= RunSteps;
+            
+            // Every earlier first sum gets added to the second one 32 times per step.
+            __m128i Previous = _mm_cvtsi32_si128((s32)(Sum1 * RunSteps));
+            __m128i First    = _mm_setzero_si128();
+            __m128i Second   = _mm_cvtsi32_si128((s32)Sum2);
+            while(RunSteps--)
             {
-                Reader->StoredBits = U32Max;
+                __m128i Bytes1 = _mm_loadu_si128((__m128i *)(At + 0));
+                __m128i Bytes2 = _mm_loadu_si128((__m128i *)(At + 16));
+                Previous = _mm_add_epi32(Previous, First);
+                First  = _mm_add_epi32(First, _mm_sad_epu8(Bytes1, Zero));
+                First  = _mm_add_epi32(First, _mm_sad_epu8(Bytes2, Zero));
+                Second = _mm_add_epi32(Second, _mm_madd_epi16(_mm_maddubs_epi16(Bytes1, Weights1), Ones));
+                Second = _mm_add_epi32(Second, _mm_madd_epi16(_mm_maddubs_epi16(Bytes2, Weights2), Ones));
+                At += 32;
             }
+            Second = _mm_add_epi32(Second, _mm_slli_epi32(Previous, 5));
+            
+            First  = _mm_add_epi32(First, _mm_shuffle_epi32(First, 0x4e));
+            First  = _mm_add_epi32(First, _mm_shuffle_epi32(First, 0xb1));
+            Second = _mm_add_epi32(Second, _mm_shuffle_epi32(Second, 0x4e));
+            Second = _mm_add_epi32(Second, _mm_shuffle_epi32(Second, 0xb1));
+            Sum1 = (Sum1 + (u32)_mm_cvtsi128_si32(First)) % ADLER32_MODULO;
+            Sum2 = (u32)_mm_cvtsi128_si32(Second) % ADLER32_MODULO;
+        }
+    }
+    
+    while(Length)
+    {
+        u64 Run = (Length < ADLER32_MAX_RUN) ? Length : ADLER32_MAX_RUN;
+        Length -= Run;
+        while(Run--)
+        {
+            Sum1 += *(At++);
+            Sum2 += Sum1;
+        }
+        Sum1 %= ADLER32_MODULO;
+        Sum2 %= ADLER32_MODULO;
+    }
+    return((Sum2 << 16) | Sum1);
+}
+
+// The Adler-32 of two streams in a row, from the sums of each one.
+static u32
+CombineAdler32(u32 Adler1, u32 Adler2, u64 Length2)
+{
+    u32 Remainder = (u32)(Length2 % ADLER32_MODULO);
+    u32 Sum1 = Adler1 & 0xffff;
+    u32 Sum2 = (Remainder * Sum1) % ADLER32_MODULO;
+    Sum1 += (Adler2 & 0xffff) + ADLER32_MODULO - 1;
+    Sum2 += (Adler1 >> 16) + (Adler2 >> 16) + ADLER32_MODULO - Remainder;
+    if(Sum1 >= ADLER32_MODULO)
+    {
+        Sum1 -= ADLER32_MODULO;
+    }
+    if(Sum1 >= ADLER32_MODULO)
+    {
+        Sum1 -= ADLER32_MODULO;
+    }
+    if(Sum2 >= 2 * ADLER32_MODULO)
+    {
+        Sum2 -= 2 * ADLER32_MODULO;
+    }
+    if(Sum2 >= ADLER32_MODULO)
+    {
+        Sum2 -= ADLER32_MODULO;
+    }
+    return((Sum2 << 16) | Sum1);
+}
+
+// Spans the decoder didn't read all the way still need their CRC.
+static b32
+SpanCRCsMatch(png_data_span *Spans, u32 SpanCount, void *FileEndpoint)
+{
+    b32 CRCsMatch = true;
+    for(u32 SpanIndex = 0; SpanIndex < SpanCount; SpanIndex++)
+    {
+        png_data_span *Span = Spans + SpanIndex;
+        if(!Span->CRCComputed)
+        {
+            Span->CRC = ~UpdateCRC32(U32Max, (u8 *)Span->Chunk->Type, (u64)(Span->End - (u8 *)Span->Chunk->Type));
+        }
+        if(!ChunkCRCMatches(Span->Chunk, FileEndpoint, Span->CRC))
+        {
+            CRCsMatch = false;
+        }
+    }
+    return(CRCsMatch);
+}
+
+// The zlib stream ends with the big endian Adler-32 of the decoded data.
+static u32
+StoredAdler32(png_data_span *Spans, u32 SpanCount)
+{
+    u32 Adler = 0;
+    u32 Shift = 0;
+    for(u32 SpanIndex = SpanCount; SpanIndex > 0 && Shift < 32; SpanIndex--)
+    {
+        png_data_span *Span = Spans + SpanIndex - 1;
+        for(u8 *At = Span->End; At > Span->Start && Shift < 32; Shift += 8)
+        {
+            Adler |= (u32)*(--At) << Shift;
         }
     }
+    return(Adler);
+}
+
+static void
+RefillBitsSlow(png_bit_reader *Reader)
+{
+    while(Reader->StoredBits <= 56)
+    {
+        if(Reader->NextByte < Reader->SegmentEnd)
+        {
+            Reader->Buffer |= (u64)*(Reader->NextByte++) << Reader->StoredBits;
+        }
+        else if(Reader->NextSpan < Reader->SpansEnd)
+        {
+            Reader->NextByte   = Reader->NextSpan->Start;
+            Reader->SegmentEnd = Reader->NextSpan->End;
+            Reader->NextSpan++;
+            continue;
+        }
+        else
+        {
+            // Past the end of the data the stream continues with zeros.
+            Reader->ZeroBytes++;
+        }
+        Reader->StoredBits += 8;
+    }
+}
+// Bits above StoredBits may already contain the start of the next byte.
+static void
+RefillBits(png_bit_reader *Reader)// Buffers at least 56 bits.
+{
+    if(Reader->SegmentEnd - Reader->NextByte >= 8)
+    {
+        Reader->Buffer |= *(u64 *)Reader->NextByte << Reader->StoredBits;
+        Reader->NextByte += (63 - Reader->StoredBits) >> 3;
+        Reader->StoredBits |= 56;
+    }
+    else
+    {
+        RefillBitsSlow(Reader);
+    }
+}
+static void
+BufferBits(png_bit_reader *Reader, u32 RequiredBitNumber)
+{
+    if(Reader->StoredBits < RequiredBitNumber)
+    {
+        RefillBits(Reader);
+    }
 }
 static u32
 ConsumeBits(png_bit_reader *Reader, u32 BitNumber)
 {
-    u32 Return = Reader->Buffer & ((1 << BitNumber) - 1);
+    u32 Return = (u32)(Reader->Buffer & ((1ull << BitNumber) - 1));
     Reader->Buffer >>= BitNumber;
     Reader->StoredBits -= BitNumber;
     return(Return);
@@ -65,21 +481,159 @@ FlushByte(png_bit_reader *Reader)
     Reader->StoredBits -= Reader->StoredBits & 0x7;
 }
 static void
-CopyBytes(png_bit_reader *Reader, u8 *To, u32 Length)// Assumes Reader->Buffer to be empty.
+CopyBytes(png_bit_reader *Reader, u8 *To, u32 Length)// Assumes Reader->Buffer to be byte aligned.
+{
+    while(Length > 0 && Reader->StoredBits >= 8)
+    {
+        Length--;
+        *(To++) = (u8)Reader->Buffer;
+        Reader->Buffer >>= 8;
+        Reader->StoredBits -= 8;
+    }
+    if(Length > 0)
+    {
+        // The buffer can hold bits of bytes that are now copied directly.
+        Reader->Buffer = 0;
+    }
+    while(Length > 0)
+    {
+        if(Reader->NextByte < Reader->SegmentEnd)
+        {
+            u8 *CopyEnd = Reader->NextByte + Length;
+            if(CopyEnd > Reader->SegmentEnd)
+            {
+                CopyEnd = Reader->SegmentEnd;
+            }
+            Length -= (u32)(CopyEnd - Reader->NextByte);
+            while(CopyEnd - Reader->NextByte >= 16)
+            {
+                _mm_storeu_si128((__m128i *)To, _mm_loadu_si128((__m128i *)Reader->NextByte));
+                Reader->NextByte += 16;
+                To += 16;
+            }
+            while(Reader->NextByte < CopyEnd)
+            {
+                *(To++) = *(Reader->NextByte++);
+            }
+        }
+        else if(Reader->NextSpan < Reader->SpansEnd)
+        {
+            Reader->NextByte   = Reader->NextSpan->Start;
+            Reader->SegmentEnd = Reader->NextSpan->End;
+            Reader->NextSpan++;
+        }
+        else
+        {
+            Reader->ZeroBytes += Length;
+            for(; Length > 0; Length--)
+            {
+                *(To++) = 0;
+            }
+        }
+    }
+}
+// Reads bytes of the spans without going through the bit buffer. Past the last span it reads zeros.
+static u32
+ReadSpanBytes(png_bit_reader *Reader, u32 Count)// Little endian, up to 4 bytes.
+{
+    u32 Value = 0;
+    for(u32 Shift = 0; Shift < Count * 8; Shift += 8)
+    {
+        while(Reader->NextByte >= Reader->SegmentEnd && Reader->NextSpan < Reader->SpansEnd)
+        {
+            Reader->NextByte   = Reader->NextSpan->Start;
+            Reader->SegmentEnd = Reader->NextSpan->End;
+            Reader->NextSpan++;
+        }
+        if(Reader->NextByte < Reader->SegmentEnd)
+        {
+            Value |= (u32)*(Reader->NextByte++) << Shift;
+        }
+        else
+        {
+            Reader->ZeroBytes++;
+        }
+    }
+    return(Value);
+}
+static void
+SkipSpanBytes(png_bit_reader *Reader, u32 Length)
+{
+    while(Length > 0)
+    {
+        if(Reader->NextByte < Reader->SegmentEnd)
+        {
+            u32 Skipped = Length;
+            if(Skipped > (u64)(Reader->SegmentEnd - Reader->NextByte))
+            {
+                Skipped = (u32)(Reader->SegmentEnd - Reader->NextByte);
+            }
+            Reader->NextByte += Skipped;
+            Length -= Skipped;
+        }
+        else if(Reader->NextSpan < Reader->SpansEnd)
+        {
+            Reader->NextByte   = Reader->NextSpan->Start;
+            Reader->SegmentEnd = Reader->NextSpan->End;
+            Reader->NextSpan++;
+        }
+        else
+        {
+            Reader->ZeroBytes += Length;
+            break;
+        }
+    }
+}
+// Same as CopyBytes, but widens the bytes to u16 entries.
+static void
+CopyBytesToEntries(png_bit_reader *Reader, u16 *To, u32 Length)
 {
+    while(Length > 0 && Reader->StoredBits >= 8)
+    {
+        Length--;
+        *(To++) = (u8)Reader->Buffer;
+        Reader->Buffer >>= 8;
+        Reader->StoredBits -= 8;
+    }
+    if(Length > 0)
+    {
+        Reader->Buffer = 0;
+    }
     while(Length > 0)
     {
         if(Reader->NextByte < Reader->SegmentEnd)
         {
-            Length--;
-            *(To++) = *(Reader->NextByte++);
+            u8 *CopyEnd = Reader->NextByte + Length;
+            if(CopyEnd > Reader->SegmentEnd)
+            {
+                CopyEnd = Reader->SegmentEnd;
+            }
+            Length -= (u32)(CopyEnd - Reader->NextByte);
+            while(CopyEnd - Reader->NextByte >= 16)
+            {
+                __m128i Bytes = _mm_loadu_si128((__m128i *)Reader->NextByte);
+                _mm_storeu_si128((__m128i *)To, _mm_unpacklo_epi8(Bytes, _mm_setzero_si128()));
+                _mm_storeu_si128((__m128i *)(To + 8), _mm_unpackhi_epi8(Bytes, _mm_setzero_si128()));
+                Reader->NextByte += 16;
+                To += 16;
+            }
+            while(Reader->NextByte < CopyEnd)
+            {
+                *(To++) = *(Reader->NextByte++);
+            }
+        }
+        else if(Reader->NextSpan < Reader->SpansEnd)
+        {
+            Reader->NextByte   = Reader->NextSpan->Start;
+            Reader->SegmentEnd = Reader->NextSpan->End;
+            Reader->NextSpan++;
         }
         else
         {
-            if(!AdvanceDataChunk(Reader))
+            Reader->ZeroBytes += Length;
+            for(; Length > 0; Length--)
             {
-                while(Length--)
-                    *(To++) = 0;
+                *(To++) = 0;
             }
         }
     }
@@ -87,7 +641,7 @@ CopyBytes(png_bit_reader *Reader, u8 *To, u32 Length)// Assumes Reader->Buffer t
 static u32
 PeekBits(png_bit_reader *Reader, u32 BitNumber)
 {
-    u32 Return = Reader->Buffer & ((1 << BitNumber) - 1);
+    u32 Return = (u32)(Reader->Buffer & ((1ull << BitNumber) - 1));
     return(Return);
 }
 static void
@@ -97,17 +651,29 @@ DropBits(png_bit_reader *Reader, u32 BitNumber)
     Reader->StoredBits -= BitNumber;
 }
 
-static void
-PopulateDictionary(deflate_code *Dictionary, u32 DictionaryLength,
+static b32
+PopulateDictionary(deflate_code *Dictionary, u32 DictionarySize, u32 RootBits,
                    u16 *SortingBuffer, u8 *Lengths, u32 SymbolCount)
 {
     u16 NumberOfUsedSymbols = 0;
+    u16 LengthFrequency[DEFLATE_MAX_LENGTH] = {};
     {
-        u8 LengthFrequency[DEFLATE_MAX_LENGTH] = {};
         for(u16 i = 0; i < SymbolCount; i++)
         {
             LengthFrequency[Lengths[i]]++;
         }
+        LengthFrequency[0] = 0;
+        
+        s32 CodesLeft = 1;
+        for(u8 i = 1; i < DEFLATE_MAX_LENGTH; i++)
+        {
+            CodesLeft = (CodesLeft << 1) - LengthFrequency[i];
+            if(CodesLeft < 0)
+            {
+                return(false);
+            }
+        }
+        
         u16 OffsetPerLength[DEFLATE_MAX_LENGTH] = {};
         for(u8 i = 2; i < DEFLATE_MAX_LENGTH; i++)
         {
@@ -123,482 +689,2772 @@ PopulateDictionary(deflate_code *Dictionary, u32 DictionaryLength,
         }
     }
     
+    u32 MaxLength = DEFLATE_MAX_LENGTH - 1;
+    while(MaxLength > 0 && LengthFrequency[MaxLength] == 0)
+    {
+        MaxLength--;
+    }
+    
+    // Unused entries stay invalid, so incomplete codes can't decode stale symbols.
+    u32 RootSize = 1 << RootBits;
+    deflate_code InvalidCode = {DEFLATE_INVALID_CODE, 0, 0};
+    for(u32 Code = 0; Code < RootSize; Code++)
+    {
+        Dictionary[Code] = InvalidCode;
+    }
+    
+    u32 TableUsed = RootSize;
+    u32 SubtableStart = 0;
+    u32 SubtablePrefix = U32Max;
+    u32 SubtableBits = 0;
+    
     u16 NextCode = 0;
     u16 i = 0; 
     while(i < NumberOfUsedSymbols)
     {
         u16 Symbol = SortingBuffer[i];
         u8 SymbolLength = Lengths[Symbol];
-        u16 AliasOffset = 1 << SymbolLength;
-        u16 Code = NextCode;
         
         deflate_code CodeData;
         CodeData.Value = Symbol;
-        CodeData.Length = SymbolLength;
-        while(Code < DictionaryLength)
-        {
-            Dictionary[Code] = CodeData;
-            Code += AliasOffset;
-        }
-        
-        i++;
-        
-        if(i < NumberOfUsedSymbols)
+        CodeData.SubtableBits = 0;
+        if(SymbolLength <= RootBits)
         {
-            u16 Increment = 1 << (SymbolLength - 1);
-            while(NextCode & Increment)
+            CodeData.Length = SymbolLength;
+            u32 AliasOffset = 1 << SymbolLength;
+            for(u32 Code = NextCode; Code < RootSize; Code += AliasOffset)
             {
-                Increment >>= 1;
+                Dictionary[Code] = CodeData;
             }
-            Assert(Increment != 0);
-            NextCode &= Increment - 1;
-            NextCode += Increment;
         }
-    }
-}
-
-static void
-Inflate(png_chunk *Chunk, void *FileEndpoint, png_decoding_buffers *Buffers, u64 BufferSize)
-{
-    u8 *To = (u8 *)Buffers->DeflateBuffer;
-    u8 *BufferEnd = To + BufferSize;
-    
-    deflate_code *LiteralDictionary  = Buffers->LiteralDictionary;
-    deflate_code *DistanceDictionary = Buffers->DistanceDictionary;
+        else
+        {
+            u32 Prefix = NextCode & (RootSize - 1);
+            if(Prefix != SubtablePrefix)
+            {
+                // Grow the subtable until the remaining codes of this prefix fill it.
+                SubtableBits = SymbolLength - RootBits;
+                s32 Left = 1 << SubtableBits;
+                while(SubtableBits + RootBits < MaxLength)
+                {
+                    Left -= LengthFrequency[SubtableBits + RootBits];
+                    if(Left <= 0)
+                    {
+                        break;
+                    }
+                    SubtableBits++;
+                    Left <<= 1;
+                }
+                
+                u32 SubtableSize = 1 << SubtableBits;
+                if(TableUsed + SubtableSize > DictionarySize)
+                {
+                    return(false);
+                }
+                SubtableStart = TableUsed;
+                SubtablePrefix = Prefix;
+                TableUsed += SubtableSize;
+                
+                for(u32 Code = SubtableStart; Code < TableUsed; Code++)
+                {
+                    Dictionary[Code] = InvalidCode;
+                }
+                
+                deflate_code Link;
+                Link.Value = (u16)SubtableStart;
+                Link.Length = (u8)RootBits;
+                Link.SubtableBits = (u8)SubtableBits;
+                Dictionary[Prefix] = Link;
+            }
+            
+            CodeData.Length = (u8)(SymbolLength - RootBits);
+            u32 AliasOffset = 1 << CodeData.Length;
+            for(u32 Code = NextCode >> RootBits; Code < (1u << SubtableBits); Code += AliasOffset)
+            {
+                Dictionary[SubtableStart + Code] = CodeData;
+            }
+        }
+        LengthFrequency[SymbolLength]--;
+        
+        i++;
+        
+        if(i < NumberOfUsedSymbols)
+        {
+            u16 Increment = 1 << (SymbolLength - 1);
+            while(NextCode & Increment)
+            {
+                Increment >>= 1;
+            }
+            Assert(Increment != 0);
+            NextCode &= Increment - 1;
+            NextCode += Increment;
+        }
+    }
+    
+    return(true);
+}
+
+static deflate_code
+DecodeSymbol(png_bit_reader *Reader, deflate_code *Dictionary, u32 RootBits)// Expects 15 buffered bits.
+{
+    deflate_code Code = Dictionary[PeekBits(Reader, RootBits)];
+    if(Code.SubtableBits)
+    {
+        DropBits(Reader, RootBits);
+        Code = Dictionary[Code.Value + PeekBits(Reader, Code.SubtableBits)];
+    }
+    DropBits(Reader, Code.Length);
+    return(Code);
+}
+
+static void
+CopyMatch(u8 *To, u32 Distance, u32 Length)// Writes up to DEFLATE_COPY_PADDING bytes past the match.
+{
+    u8 *From = To - Distance;
+    u8 *CopyEnd = To + Length;
+    if(Distance >= 32)
+    {
+        do
+        {
+            __m128i Low  = _mm_loadu_si128((__m128i *)From);
+            __m128i High = _mm_loadu_si128((__m128i *)(From + 16));
+            _mm_storeu_si128((__m128i *)To, Low);
+            _mm_storeu_si128((__m128i *)(To + 16), High);
+            From += 32;
+            To   += 32;
+        } while(To < CopyEnd);
+    }
+    else if(Distance >= 16)
+    {
+        do
+        {
+            _mm_storeu_si128((__m128i *)To, _mm_loadu_si128((__m128i *)From));
+            From += 16;
+            To   += 16;
+        } while(To < CopyEnd);
+    }
+    else if(Distance >= 8)
+    {
+        do
+        {
+            *(u64 *)To = *(u64 *)From;
+            From += 8;
+            To   += 8;
+        } while(To < CopyEnd);
+    }
+    else if(Distance == 1)
+    {
+        __m128i Run = _mm_set1_epi8((char)*From);
+        do
+        {
+            _mm_storeu_si128((__m128i *)To, Run);
+            _mm_storeu_si128((__m128i *)(To + 16), Run);
+            To += 32;
+        } while(To < CopyEnd);
+    }
+    else
+    {
+        // Repeat the period across 16 bytes and advance by whole periods.
+        u8 Pattern[16];
+        for(u32 i = 0; i < 16; i++)
+        {
+            Pattern[i] = From[i % Distance];
+        }
+        __m128i Period = _mm_loadu_si128((__m128i *)Pattern);
+        u32 Step = 16 - (16 % Distance);
+        do
+        {
+            _mm_storeu_si128((__m128i *)To, Period);
+            To += Step;
+        } while(To < CopyEnd);
+    }
+}
+
+// The scalar kernels are the reference for the SIMD kernels below, which also fall back on them for
+// rows that are too short. At points behind the filter type byte.
+static void
+UndoFilterNone(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)
+{
+    while(At < RowEnd)
+    {
+        *(To++) = *(At++);
+    }
+}
+
+static void
+UndoFilterSub(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)
+{
+    u8 *Left = To;
+    u8 *SecondPixel = At + BytesPerPixel;
+    while(At < SecondPixel && At < RowEnd)
+    {
+        *(To++) = *(At++);
+    }
+    while(At < RowEnd)
+    {
+        *(To++) = *(At++) + *(Left++);
+    }
+}
+
+static void
+UndoFilterUp(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)
+{
+    u8 *Up = LastRow;
+    while(At < RowEnd)
+    {
+        *(To++) = *(At++) + *(Up++);
+    }
+}
+
+static void
+UndoFilterAverage(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)
+{
+    u8 *Up = LastRow;
+    u8 *Left = To;
+    u8 *SecondPixel = At + BytesPerPixel;
+    while(At < SecondPixel && At < RowEnd)
+    {
+        *(To++) = *(At++) + (*(Up++) / 2);
+    }
+    while(At < RowEnd)
+    {
+        *(To++) = *(At++) + (u8)(((u16)*(Left++) + (u16)*(Up++)) / 2);
+    }
+}
+
+static u8
+PaethPredictor(u8 a, u8 b, u8 c)
+{
+    s32 pa = (s32)b - (s32)c;
+    s32 pb = (s32)a - (s32)c;
+    s32 pc = Absolute(pa + pb);
+    pa     = Absolute(pa);
+    pb     = Absolute(pb);
+    
+    u8 Pr = a;
+    if(pb < pa)
+    {
+        pa = pb;
+        Pr = b;
+    }
+    if(pc < pa)
+    {
+        Pr = c;
+    }
+    return(Pr);
+}
+
+static void
+UndoFilterPaeth(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)
+{
+    u8 *a = To;
+    u8 *b = LastRow;
+    u8 *c = LastRow;
+    u8 *SecondPixel = At + BytesPerPixel;
+    while(At < SecondPixel && At < RowEnd)
+    {
+        *(To++) = *(At++) + *(b++);
+    }
+    while(At < RowEnd)
+    {
+        *(To++) = *(At++) + PaethPredictor(*(a++), *(b++), *(c++));
+    }
+}
+
+static void
+UndoFilterNoneSSE2(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)
+{
+    while(RowEnd - At >= 16)
+    {
+        _mm_storeu_si128((__m128i *)To, _mm_loadu_si128((__m128i *)At));
+        At += 16;
+        To += 16;
+    }
+    UndoFilterNone(At, To, RowEnd, LastRow, BytesPerPixel);
+}
+
+static void
+UndoFilterUpSSE2(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)
+{
+    while(RowEnd - At >= 16)
+    {
+        __m128i Up = _mm_loadu_si128((__m128i *)LastRow);
+        _mm_storeu_si128((__m128i *)To, _mm_add_epi8(_mm_loadu_si128((__m128i *)At), Up));
+        At      += 16;
+        To      += 16;
+        LastRow += 16;
+    }
+    UndoFilterUp(At, To, RowEnd, LastRow, BytesPerPixel);
+}
+
+static void
+UndoFilterUpAVX2(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)
+{
+    while(RowEnd - At >= 32)
+    {
+        __m256i Up = _mm256_loadu_si256((__m256i *)LastRow);
+        _mm256_storeu_si256((__m256i *)To, _mm256_add_epi8(_mm256_loadu_si256((__m256i *)At), Up));
+        At      += 32;
+        To      += 32;
+        LastRow += 32;
+    }
+    UndoFilterUpSSE2(At, To, RowEnd, LastRow, BytesPerPixel);
+}
+
+static void
+UndoFilterSubSSE2(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)// For 1, 2, 4 and 8 bytes per pixel.
+{
+    if(RowEnd - At < 16)
+    {
+        UndoFilterSub(At, To, RowEnd, LastRow, BytesPerPixel);
+        return;
+    }
+    
+    // Sums up 16 bytes at once with a prefix sum over whole pixels, then adds the last pixel before them.
+    __m128i Left = _mm_setzero_si128();
+    while(RowEnd - At >= 16)
+    {
+        __m128i Sum = _mm_loadu_si128((__m128i *)At);
+        switch(BytesPerPixel)
+        {
+            case 1: Sum = _mm_add_epi8(Sum, _mm_slli_si128(Sum, 1));// fall through
+            case 2: Sum = _mm_add_epi8(Sum, _mm_slli_si128(Sum, 2));// fall through
+            case 4: Sum = _mm_add_epi8(Sum, _mm_slli_si128(Sum, 4));// fall through
+            case 8: Sum = _mm_add_epi8(Sum, _mm_slli_si128(Sum, 8));
+        }
+        Sum = _mm_add_epi8(Sum, Left);
+        _mm_storeu_si128((__m128i *)To, Sum);
+        
+        switch(BytesPerPixel)
+        {
+            case 1: Left = _mm_set1_epi8((char)To[15]); break;
+            case 2: Left = _mm_shufflehi_epi16(Sum, 0xff); Left = _mm_unpackhi_epi64(Left, Left); break;
+            case 4: Left = _mm_shuffle_epi32(Sum, 0xff); break;
+            case 8: Left = _mm_unpackhi_epi64(Sum, Sum); break;
+        }
+        At += 16;
+        To += 16;
+    }
+    
+    u8 *LeftByte = To - BytesPerPixel;
+    while(At < RowEnd)
+    {
+        *(To++) = *(At++) + *(LeftByte++);
+    }
+}
+
+// The pixel kernels below carry the previous pixel in a register and move one pixel at a time, but
+// load and store 8 bytes. The bytes behind the pixel get overwritten by the next one, and the last
+// pixels that would overrun the row are handled by a scalar loop.
+static void
+UndoFilterSubPixelsSSE2(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)// For 3 and 6 bytes per pixel.
+{
+    if(RowEnd - At < 8)
+    {
+        UndoFilterSub(At, To, RowEnd, LastRow, BytesPerPixel);
+        return;
+    }
+    
+    __m128i a = _mm_setzero_si128();
+    while(RowEnd - At >= 8)
+    {
+        a = _mm_add_epi8(_mm_loadl_epi64((__m128i *)At), a);
+        _mm_storel_epi64((__m128i *)To, a);
+        At += BytesPerPixel;
+        To += BytesPerPixel;
+    }
+    
+    u8 *Left = To - BytesPerPixel;
+    while(At < RowEnd)
+    {
+        *(To++) = *(At++) + *(Left++);
+    }
+}
+
+static void
+UndoFilterAverageSSE2(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)// For 3 to 8 bytes per pixel.
+{
+    if(RowEnd - At < 8)
+    {
+        UndoFilterAverage(At, To, RowEnd, LastRow, BytesPerPixel);
+        return;
+    }
+    
+    // _mm_avg_epu8 rounds up, so the lowest bit of a ^ b is subtracted again.
+    __m128i One = _mm_set1_epi8(1);
+    __m128i a   = _mm_setzero_si128();
+    while(RowEnd - At >= 8)
+    {
+        __m128i b = _mm_loadl_epi64((__m128i *)LastRow);
+        __m128i Average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), One));
+        a = _mm_add_epi8(_mm_loadl_epi64((__m128i *)At), Average);
+        _mm_storel_epi64((__m128i *)To, a);
+        At      += BytesPerPixel;
+        To      += BytesPerPixel;
+        LastRow += BytesPerPixel;
+    }
+    
+    u8 *Left = To - BytesPerPixel;
+    while(At < RowEnd)
+    {
+        *(To++) = *(At++) + (u8)(((u16)*(Left++) + (u16)*(LastRow++)) / 2);
+    }
+}
+
+// Branchless Paeth predictor on 16 bit lanes, with the same tie breaking as PaethPredictor.
+inline __m128i
+PaethSelect(__m128i a, __m128i b, __m128i c, __m128i pa, __m128i pb, __m128i pc)
+{
+    __m128i UseB = _mm_cmplt_epi16(pb, pa);
+    __m128i Pr   = _mm_or_si128(_mm_and_si128(UseB, b), _mm_andnot_si128(UseB, a));
+    pa = _mm_min_epi16(pa, pb);
+    __m128i UseC = _mm_cmplt_epi16(pc, pa);
+    return(_mm_or_si128(_mm_and_si128(UseC, c), _mm_andnot_si128(UseC, Pr)));
+}
+
+inline __m128i
+Absolute16SSE2(__m128i Value)
+{
+    return(_mm_max_epi16(Value, _mm_sub_epi16(_mm_setzero_si128(), Value)));
+}
+
+static void
+UndoFilterPaethSSE2(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)// For 3 to 8 bytes per pixel.
+{
+    if(RowEnd - At < 8)
+    {
+        UndoFilterPaeth(At, To, RowEnd, LastRow, BytesPerPixel);
+        return;
+    }
+    
+    __m128i Zero = _mm_setzero_si128();
+    __m128i a    = Zero;
+    __m128i c    = Zero;
+    while(RowEnd - At >= 8)
+    {
+        __m128i b  = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)LastRow), Zero);
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = Absolute16SSE2(_mm_add_epi16(pa, pb));
+        __m128i Pr = PaethSelect(a, b, c, Absolute16SSE2(pa), Absolute16SSE2(pb), pc);
+        
+        __m128i Pixel = _mm_add_epi8(_mm_loadl_epi64((__m128i *)At), _mm_packus_epi16(Pr, Pr));
+        _mm_storel_epi64((__m128i *)To, Pixel);
+        a = _mm_unpacklo_epi8(Pixel, Zero);
+        c = b;
+        At      += BytesPerPixel;
+        To      += BytesPerPixel;
+        LastRow += BytesPerPixel;
+    }
+    
+    u8 *Left     = To - BytesPerPixel;
+    u8 *UpLeft   = LastRow - BytesPerPixel;
+    while(At < RowEnd)
+    {
+        *(To++) = *(At++) + PaethPredictor(*(Left++), *(LastRow++), *(UpLeft++));
+    }
+}
+
+static void
+UndoFilterPaethSSSE3(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)// For 3 to 8 bytes per pixel.
+{
+    if(RowEnd - At < 8)
+    {
+        UndoFilterPaeth(At, To, RowEnd, LastRow, BytesPerPixel);
+        return;
+    }
+    
+    __m128i Zero = _mm_setzero_si128();
+    __m128i a    = Zero;
+    __m128i c    = Zero;
+    while(RowEnd - At >= 8)
+    {
+        __m128i b  = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)LastRow), Zero);
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+        __m128i Pr = PaethSelect(a, b, c, _mm_abs_epi16(pa), _mm_abs_epi16(pb), pc);
+        
+        __m128i Pixel = _mm_add_epi8(_mm_loadl_epi64((__m128i *)At), _mm_packus_epi16(Pr, Pr));
+        _mm_storel_epi64((__m128i *)To, Pixel);
+        a = _mm_unpacklo_epi8(Pixel, Zero);
+        c = b;
+        At      += BytesPerPixel;
+        To      += BytesPerPixel;
+        LastRow += BytesPerPixel;
+    }
+    
+    u8 *Left     = To - BytesPerPixel;
+    u8 *UpLeft   = LastRow - BytesPerPixel;
+    while(At < RowEnd)
+    {
+        *(To++) = *(At++) + PaethPredictor(*(Left++), *(LastRow++), *(UpLeft++));
+    }
+}
+
+// Picks the fastest kernel per filter type for the pixel size and the instruction sets of the CPU.
+// Average and Paeth have no vector kernels for 1 and 2 bytes per pixel, as there are too few
+// bytes per pixel to make up for the serial dependency on the pixel to the left.
+static void
+SelectUnfilterKernels(png_unfilter_kernel **Kernels, u32 BytesPerPixel)
+{
+    cpu_features Features = GetCPUFeatures();
+    
+    Kernels[0] = UndoFilterNoneSSE2;
+    Kernels[1] = UndoFilterSubSSE2;
+    Kernels[2] = UndoFilterUpSSE2;
+    Kernels[3] = UndoFilterAverage;
+    Kernels[4] = UndoFilterPaeth;
+    
+    if(Features.AVX2)
+    {
+        Kernels[2] = UndoFilterUpAVX2;
+    }
+    if(BytesPerPixel == 3 || BytesPerPixel == 6)
+    {
+        Kernels[1] = UndoFilterSubPixelsSSE2;
+    }
+    if(BytesPerPixel >= 3)
+    {
+        Kernels[3] = UndoFilterAverageSSE2;
+        Kernels[4] = Features.SSSE3 ? UndoFilterPaethSSSE3 : UndoFilterPaethSSE2;
+    }
+}
+
+static u64
+PassScanlineLength(u32 Width, u32 Height, u32 BitsPerPixel, u32 Pass)// Includes the filter byte, 0 for empty passes.
+{
+    u32 oX = INTERLACE_X_OFFSET[Pass];
+    u32 iX = INTERLACE_X_INCREMENT[Pass];
+    if(oX >= Width || INTERLACE_Y_OFFSET[Pass] >= Height)
+    {
+        return(0);
+    }
+    u64 Columns = (Width - oX + iX - 1) / iX;
+    return(1 + (Columns * BitsPerPixel + 7) / 8);
+}
+
+static u64
+DecodedDataSize(u32 Width, u32 Height, u32 BitsPerPixel, b32 Interlaced)
+{
+    u64 Size = 0;
+    if(Interlaced)
+    {
+        for(u32 Pass = 0; Pass < 7; Pass++)
+        {
+            u32 oY = INTERLACE_Y_OFFSET[Pass];
+            u32 iY = INTERLACE_Y_INCREMENT[Pass];
+            u64 ScanlineLength = PassScanlineLength(Width, Height, BitsPerPixel, Pass);
+            if(ScanlineLength)
+            {
+                Size += (Height - oY + iY - 1) / iY * ScanlineLength;
+            }
+        }
+    }
+    else
+    {
+        Size = (u64)Height * (1 + ((u64)BitsPerPixel * (u64)Width + 7) / 8);
+    }
+    return(Size);
+}
+
+// Only the last 32 KB of decoded data are needed for back-references, so the data gets
+// unfiltered into the image while decoding, instead of holding the whole stream in memory.
+static u64
+InflateWindowSize(u32 Width, u32 Height, u32 BitsPerPixel, b32 Interlaced)
+{
+    u64 WindowSize = DecodedDataSize(Width, Height, BitsPerPixel, Interlaced);
+    u64 StreamBufferSize = DEFLATE_WINDOW_SIZE + 1 + ((u64)BitsPerPixel * (u64)Width + 7) / 8 + PNG_STREAM_CHUNK_SIZE;
+    if(WindowSize > StreamBufferSize)
+    {
+        WindowSize = StreamBufferSize;
+    }
+    return(WindowSize);
+}
+
+static void
+BeginPass(png_scanline_state *State)// Moves on to the next pass that contains pixels.
+{
+    while(State->Pass < 7)
+    {
+        State->ScanlineLength = PassScanlineLength(State->Width, State->Height, State->BitsPerPixel, State->Pass);
+        if(State->ScanlineLength)
+        {
+            State->Y = INTERLACE_Y_OFFSET[State->Pass];
+            for(u32 I = 0; I < State->BytesPerRow; I++)
+            {
+                State->LastRow[I] = 0;
+            }
+            return;
+        }
+        State->Pass++;
+    }
+    State->Finished = true;
+}
+
+static void
+InitializeScanlines(png_scanline_state *State, u8 *Image, u8 *RowBuffers,
+                    u32 Width, u32 Height, u32 BitsPerPixel, b32 Interlaced)
+{
+    State->Image         = Image;
+    State->Width         = Width;
+    State->Height        = Height;
+    State->BitsPerPixel  = BitsPerPixel;
+    State->BytesPerPixel = (BitsPerPixel + 7) / 8;
+    State->BytesPerRow   = ((u64)BitsPerPixel * (u64)Width + 7) / 8;
+    State->Interlaced    = Interlaced;
+    State->Pass          = 0;
+    SelectUnfilterKernels(State->UnfilterKernels, State->BytesPerPixel);
+    State->Y             = 0;
+    State->FirstStoredRow = 0;
+    State->EndRow        = Height;
+    State->Finished      = (Width == 0 || Height == 0);
+    State->Verify        = VerifyChecksums;
+    State->Adler         = 1;
+    
+    // Interlaced scanlines get unfiltered into the row buffers and then scattered into the image.
+    // Otherwise the first row buffer is the zero row above the image.
+    State->LastRow = RowBuffers;
+    State->Row     = RowBuffers + State->BytesPerRow;
+    if(Interlaced && !State->Finished)
+    {
+        BeginPass(State);
+    }
+    else
+    {
+        State->ScanlineLength = 1 + State->BytesPerRow;
+    }
+}
+
+// Fills every pixel the later passes will decode with the decoded pixel at the top left of its block.
+// The rows inside a block are copies of its first row. Only the first rows the pass decoded into need to
+// be filled in again, the others kept the same block width since the last preview.
+static void
+ReplicateBlocks(u8 *Image, u32 Width, u32 Height, u64 BytesPerRow, u32 BytesPerPixel, u32 Pass)
+{
+    u32 BlockWidth  = INTERLACE_BLOCK_WIDTH[Pass];
+    u32 BlockHeight = INTERLACE_BLOCK_HEIGHT[Pass];
+    u64 RowSize = (u64)Width * BytesPerPixel;
+    for(u32 Y = 0; Y < Height; Y++)
+    {
+        u8 *Row = Image + Y * BytesPerRow;
+        if(Y % BlockHeight)
+        {
+            u8 *From = Row - BytesPerRow;
+            u64 I = 0;
+            for(; I + 16 <= RowSize; I += 16)
+            {
+                _mm_storeu_si128((__m128i *)(Row + I), _mm_loadu_si128((__m128i *)(From + I)));
+            }
+            for(; I < RowSize; I++)
+            {
+                Row[I] = From[I];
+            }
+        }
+        else if(Y % INTERLACE_Y_INCREMENT[Pass] != INTERLACE_Y_OFFSET[Pass] || BlockWidth == 1)
+        {
+            continue;
+        }
+        else if(BytesPerPixel == 4)
+        {
+            u32 *Pixels = (u32 *)Row;
+            for(u32 X = 0; X < Width; X++)
+            {
+                Pixels[X] = Pixels[X - X % BlockWidth];
+            }
+        }
+        else if(BytesPerPixel == 8)
+        {
+            u64 *Pixels = (u64 *)Row;
+            for(u32 X = 0; X < Width; X++)
+            {
+                Pixels[X] = Pixels[X - X % BlockWidth];
+            }
+        }
+        else
+        {
+            for(u32 X = 0; X < Width; X++)
+            {
+                u8 *To = Row + (u64)X * BytesPerPixel;
+                u8 *From = Row + (u64)(X - X % BlockWidth) * BytesPerPixel;
+                for(u32 P = 0; P < BytesPerPixel; P++)
+                {
+                    To[P] = From[P];
+                }
+            }
+        }
+    }
+}
+
+// Stores the image as it is after the current pass. Images that get converted build the preview in the
+// converted image, from the rows the pass decoded into. Otherwise the image itself gets filled in and the
+// later passes overwrite it. Formats with less than 8 bits per pixel are always converted.
+static void
+ShowPassPreview(png_scanline_state *State)
+{
+    png_preview *Preview = State->Preview;
+    u32 Pass = State->Pass;
+    if(Preview->Conversion)
+    {
+        for(u32 Y = INTERLACE_Y_OFFSET[Pass]; Y < State->Height; Y += INTERLACE_Y_INCREMENT[Pass])
+        {
+            ConvertRows(Preview->Conversion, State->Image, Preview->Converted, Y, 1);
+        }
+        u32 BytesPerPixel = Preview->Conversion->TargetBytesPerPixel;
+        ReplicateBlocks(Preview->Converted, State->Width, State->Height, (u64)State->Width * BytesPerPixel,
+                        BytesPerPixel, Pass);
+        StorePreviewImage(Preview->Converted, Preview->Processor);
+    }
+    else
+    {
+        ReplicateBlocks(State->Image, State->Width, State->Height, State->BytesPerRow, State->BytesPerPixel, Pass);
+        StorePreviewImage(State->Image, Preview->Processor);
+    }
+}
+
+// For each byte of a pass with 1, 2 or 4 bits per pixel, the bits its pixels take up in the iX bytes
+// of the image row that it spreads over.
+static void
+InitializeInterlaceSpread()
+{
+    if(InterlaceSpreadReady)
+    {
+        return;
+    }
+    for(u32 DepthIndex = 0; DepthIndex < 3; DepthIndex++)
+    {
+        u32 BitsPerPixel  = 1 << DepthIndex;
+        u32 PixelsPerByte = 8 / BitsPerPixel;
+        for(u32 Pass = 0; Pass < 6; Pass++)
+        {
+            u32 FirstBit = (INTERLACE_X_OFFSET[Pass] * BitsPerPixel) % 8;
+            u32 BitStep  = INTERLACE_X_INCREMENT[Pass] * BitsPerPixel;
+            for(u32 Value = 0; Value < 256; Value++)
+            {
+                u64 Spread = 0;
+                for(u32 Pixel = 0; Pixel < PixelsPerByte; Pixel++)
+                {
+                    u64 Sample = (Value >> (8 - BitsPerPixel * (Pixel + 1))) & ((1 << BitsPerPixel) - 1);
+                    u32 Bit = FirstBit + Pixel * BitStep;
+                    Spread |= Sample << ((Bit / 8) * 8 + 8 - BitsPerPixel - Bit % 8);
+                }
+                InterlaceSpread[DepthIndex][Pass][Value] = Spread;
+            }
+        }
+    }
+    InterlaceSpreadReady = true;
+}
+
+// Writes the pixels of a pass row into their places in the image row. The pixels of the other passes
+// stay untouched, the image starts out zeroed so bits can be or'ed in.
+static void
+ScatterPassPixels(u8 *From, u8 *To, u32 Width, u32 BitsPerPixel, u64 BytesPerRow, u32 Pass)
+{
+    u32 oX = INTERLACE_X_OFFSET[Pass];
+    u32 iX = INTERLACE_X_INCREMENT[Pass];
+    u32 X  = oX;
+    if(BitsPerPixel < 8)
+    {
+        // Whole bytes of the pass get spread over iX bytes of the image with one lookup.
+        u32 PixelsPerByte = 8 / BitsPerPixel;
+        u64 *Spread = InterlaceSpread[BitsPerPixel >> 1][Pass];
+        u64 ToByte  = (oX * BitsPerPixel) / 8;
+        for(; X + (PixelsPerByte - 1) * iX < Width && ToByte + iX <= BytesPerRow; X += PixelsPerByte * iX)
+        {
+            u64 Bits = Spread[*(From++)];
+            switch(iX)
+            {
+                case 2: *(u16 *)(To + ToByte) = (u16)(*(u16 *)(To + ToByte) | Bits); break;
+                case 4: *(u32 *)(To + ToByte) = (u32)(*(u32 *)(To + ToByte) | Bits); break;
+                case 8: *(u64 *)(To + ToByte) |= Bits; break;
+            }
+            ToByte += iX;
+        }
+        
+        u32 PixelMask   = 0x100 - (1 << (8 - BitsPerPixel));
+        u64 ImageBit    = (u64)X * BitsPerPixel;
+        u8  CurrentByte = 0;
+        u32 BitsShifted = 8;
+        for(; X < Width; X += iX)
+        {
+            if(BitsShifted >= 8)
+            {
+                CurrentByte = *(From++);
+                BitsShifted = 0;
+            }
+            
+            To[ImageBit/8] |= (CurrentByte & PixelMask) >> (ImageBit & 7);
+            CurrentByte   <<= BitsPerPixel;
+            BitsShifted    += BitsPerPixel;
+            ImageBit       += iX * BitsPerPixel;
+        }
+        return;
+    }
+    
+    u32 BytesPerPixel = BitsPerPixel / 8;
+    if(iX <= 4 && BytesPerPixel <= 4 && BytesPerPixel != 3)
+    {
+        // Every pixel gets repeated iX times with unpacks and blended over 16 bytes of the image row.
+        u8 MaskBytes[16];
+        for(u32 Byte = 0; Byte < 16; Byte++)
+        {
+            MaskBytes[Byte] = ((Byte / BytesPerPixel) % iX == oX) ? U8Max : 0;
+        }
+        __m128i Mask = _mm_loadu_si128((__m128i *)MaskBytes);
+        u64 Block = 0;
+        for(; Block + 16 <= BytesPerRow; Block += 16)
+        {
+            __m128i Pixels;
+            if(iX == 2)
+            {
+                Pixels = _mm_loadl_epi64((__m128i *)From);
+                From += 8;
+            }
+            else
+            {
+                Pixels = _mm_cvtsi32_si128(*(s32 *)From);
+                From += 4;
+            }
+            switch(BytesPerPixel)
+            {
+                case 1:
+                {
+                    Pixels = _mm_unpacklo_epi8(Pixels, Pixels);
+                    Pixels = (iX == 4) ? _mm_unpacklo_epi16(Pixels, Pixels) : Pixels;
+                } break;
+                case 2:
+                {
+                    Pixels = _mm_unpacklo_epi16(Pixels, Pixels);
+                    Pixels = (iX == 4) ? _mm_unpacklo_epi32(Pixels, Pixels) : Pixels;
+                } break;
+                case 4:
+                {
+                    Pixels = _mm_unpacklo_epi32(Pixels, Pixels);
+                    Pixels = (iX == 4) ? _mm_unpacklo_epi64(Pixels, Pixels) : Pixels;
+                } break;
+            }
+            __m128i *Row = (__m128i *)(To + Block);
+            __m128i Others = _mm_andnot_si128(Mask, _mm_loadu_si128(Row));
+            _mm_storeu_si128(Row, _mm_or_si128(Others, _mm_and_si128(Mask, Pixels)));
+        }
+        X += (u32)(Block / BytesPerPixel);
+    }
+    
+    for(; X < Width; X += iX)
+    {
+        u8 *Pixel = To + (u64)X * BytesPerPixel;
+        switch(BytesPerPixel)
+        {
+            case 1: *Pixel = *From; break;
+            case 2: *(u16 *)Pixel = *(u16 *)From; break;
+            case 3: *(u16 *)Pixel = *(u16 *)From; Pixel[2] = From[2]; break;
+            case 4: *(u32 *)Pixel = *(u32 *)From; break;
+            case 6: *(u32 *)Pixel = *(u32 *)From; *(u16 *)(Pixel + 4) = *(u16 *)(From + 4); break;
+            case 8: *(u64 *)Pixel = *(u64 *)From; break;
+        }
+        From += BytesPerPixel;
+    }
+}
+
+static void
+UnfilterScanline(png_scanline_state *State, u8 *Scanline)
+{
+    u8 *ScanlineEnd = Scanline + State->ScanlineLength;
+    u8 FilterType = *Scanline;
+    if(!State->Interlaced)
+    {
+        u8 *Row = State->Row;
+        if(State->Y >= State->FirstStoredRow)
+        {
+            Row = State->Image + (State->Y - State->FirstStoredRow) * State->BytesPerRow;
+        }
+        else
+        {
+            // Alternates between the row buffers, the row only serves as the row above the next one.
+            State->Row = State->LastRow;
+        }
+        if(FilterType < 5)
+        {
+            State->UnfilterKernels[FilterType](Scanline + 1, Row, ScanlineEnd, State->LastRow, State->BytesPerPixel);
+        }
+        State->LastRow = Row;
+        if(++State->Y >= State->EndRow)
+        {
+            State->Finished = true;
+        }
+        return;
+    }
+    
+    u8 *Target = State->Image + State->Y * State->BytesPerRow;
+    if(State->Pass == 6)
+    {
+        // The last pass holds whole rows, which get unfiltered straight into the image.
+        if(FilterType < 5)
+        {
+            State->UnfilterKernels[FilterType](Scanline + 1, Target, ScanlineEnd, State->LastRow, State->BytesPerPixel);
+        }
+        State->LastRow = Target;
+    }
+    else
+    {
+        if(FilterType < 5)
+        {
+            State->UnfilterKernels[FilterType](Scanline + 1, State->Row, ScanlineEnd, State->LastRow, State->BytesPerPixel);
+        }
+        ScatterPassPixels(State->Row, Target, State->Width, State->BitsPerPixel, State->BytesPerRow, State->Pass);
+        
+        u8* Temp = State->LastRow;
+        State->LastRow = State->Row;
+        State->Row = Temp;
+    }
+    
+    State->Y += INTERLACE_Y_INCREMENT[State->Pass];
+    if(State->Pass == 6 && State->Y >= State->EndRow && State->EndRow < State->Height)
+    {
+        // The rest of the last pass lies below the needed rows.
+        State->Finished = true;
+    }
+    else if(State->Y >= State->Height)
+    {
+        if(State->Preview && State->Pass < 6)
+        {
+            ShowPassPreview(State);
+        }
+        State->Pass++;
+        BeginPass(State);
+    }
+}
+
+// Unfilters all complete scanlines. If there is no room for BytesNeeded more bytes, the window slides
+// back, while keeping the last DEFLATE_WINDOW_SIZE bytes for back-references.
+static b32
+FlushWindow(png_inflate_window *Window, png_scanline_state *Scanlines, u8 **To, u64 BytesNeeded)
+{
+    png_pipeline *Pipeline = Scanlines->Pipeline;
+    u8 *Unfiltered = Window->Unfiltered;
+    if(Pipeline)
+    {
+        // Another thread unfilters the scanlines, it only needs to know how far the stream is decoded.
+        u64 Decoded = Pipeline->WindowStart + (u64)(*To - Window->Start);
+        if(Decoded >= Pipeline->StreamSize)
+        {
+            Scanlines->Finished = true;
+        }
+        SignalCounter(&Pipeline->BytesDecoded, Decoded);
+        if(Decoded > Pipeline->StreamSize)
+        {
+            Window->Error = "The decoded data stream overflows the image buffer.";
+            return(false);
+        }
+        if(*To + BytesNeeded <= Window->End)
+        {
+            return(true);
+        }
+        
+        // Once the other thread waits for a scanline that isn't decoded yet, it doesn't read the window until
+        // BytesDecoded moves on, so the window can slide back behind that scanline.
+        WaitForCounter(&Pipeline->ScanlineEnd, Decoded + 1);
+        Unfiltered = Window->Start + (Pipeline->BytesUnfiltered - Pipeline->WindowStart);
+        Window->Unfiltered = Unfiltered;
+    }
+    else
+    {
+        if(Scanlines->RowAboveUnknown && Scanlines->Y == 0 && *To > Unfiltered && *Unfiltered >= 2)
+        {
+            Window->Error = "The first scanline of the segment depends on the previous segment.";
+            return(false);
+        }
+        while(!Scanlines->Finished && (u64)(*To - Unfiltered) >= Scanlines->ScanlineLength)
+        {
+            u8 *Scanline = Unfiltered;
+            Unfiltered += Scanlines->ScanlineLength;
+            UnfilterScanline(Scanlines, Scanline);
+        }
+        if(Scanlines->Verify)
+        {
+            Scanlines->Adler = UpdateAdler32(Scanlines->Adler, Window->Unfiltered,
+                                             (u64)(Unfiltered - Window->Unfiltered));
+        }
+        Window->Unfiltered = Unfiltered;
+        if(Scanlines->Finished && Scanlines->EndRow < Scanlines->Height)
+        {
+            // Stops inflating without an error, the rest of the stream only holds rows below the needed ones.
+            return(false);
+        }
+        if(Scanlines->Finished && *To > Unfiltered)
+        {
+            Window->Error = "The decoded data stream overflows the image buffer.";
+            return(false);
+        }
+        if(*To + BytesNeeded <= Window->End)
+        {
+            return(true);
+        }
+    }
+    
+    u8 *Keep = Window->Start;
+    if(*To - Window->Start > DEFLATE_WINDOW_SIZE)
+    {
+        Keep = *To - DEFLATE_WINDOW_SIZE;
+    }
+    if(Keep > Unfiltered)
+    {
+        Keep = Unfiltered;
+    }
+    if(Keep > Window->Start)
+    {
+        // Forward copy, the destination always lies in front of the source.
+        u8 *From = Keep;
+        u8 *Destination = Window->Start;
+        while(*To - From >= 16)
+        {
+            _mm_storeu_si128((__m128i *)Destination, _mm_loadu_si128((__m128i *)From));
+            From += 16;
+            Destination += 16;
+        }
+        while(From < *To)
+        {
+            *(Destination++) = *(From++);
+        }
+        Window->Unfiltered -= Keep - Window->Start;
+        if(Pipeline)
+        {
+            // Published along with the next BytesDecoded.
+            Pipeline->WindowStart += (u64)(Keep - Window->Start);
+        }
+        *To = Destination;
+    }
+    
+    if(*To + BytesNeeded > Window->End)
+    {
+        Window->Error = "The decoded data stream overflows the image buffer.";
+        return(false);
+    }
+    return(true);
+}
+
+// Valid encoders only produce complete codes, or a single code of length 1.
+static b32
+IsCompleteCode(u8 *Lengths, u32 SymbolCount)
+{
+    u32 Space = 0;
+    u32 UsedSymbols = 0;
+    for(u32 i = 0; i < SymbolCount; i++)
+    {
+        if(Lengths[i])
+        {
+            Space += (1 << (DEFLATE_MAX_LENGTH - 1)) >> Lengths[i];
+            UsedSymbols++;
+        }
+    }
+    return(Space == (1 << (DEFLATE_MAX_LENGTH - 1)) || (UsedSymbols == 1 && Space == (1 << (DEFLATE_MAX_LENGTH - 2))));
+}
+
+// The fixed codes never change, so their dictionaries are built once and shared by every decode.
+// None of the codes is longer than the root bits, so they need no subtables.
+static void
+InitializeFixedDictionaries()
+{
+    if(FixedDictionariesReady)
+    {
+        return;
+    }
+    u8 Lengths[320];
+    u16 SortingBuffer[288];
+    u32 n = 0;
+    while(n < 144)
+        Lengths[n++] = 8;
+    while(n < 256)
+        Lengths[n++] = 9;
+    while(n < 280)
+        Lengths[n++] = 7;
+    while(n < 288)
+        Lengths[n++] = 8;
+    while(n < 320)
+        Lengths[n++] = 5;
+    PopulateDictionary(FixedLiteralDictionary, 1 << DEFLATE_LITERAL_ROOT_BITS, DEFLATE_LITERAL_ROOT_BITS,
+                       SortingBuffer, Lengths, 288);
+    PopulateDictionary(FixedDistanceDictionary, 1 << DEFLATE_DISTANCE_ROOT_BITS, DEFLATE_DISTANCE_ROOT_BITS,
+                       SortingBuffer, Lengths + 288, 32);
+    FixedDictionariesReady = true;
+}
+
+// Points the dictionaries at the fixed ones, or reads the code lengths of a block with dynamic tables
+// and builds both dictionaries in the buffers.
+static char *
+ReadHuffmanTables(png_bit_reader *BitReader, png_decoding_buffers *Buffers, u32 CompressionType,
+                  b32 RequireCompleteCodes, deflate_code **LiteralDictionary, deflate_code **DistanceDictionary)
+{
+    if(CompressionType == 1)//Fixed table
+    {
+        *LiteralDictionary  = FixedLiteralDictionary;
+        *DistanceDictionary = FixedDistanceDictionary;
+        return(0);
+    }
+    
+    u8 *Lengths = Buffers->Lengths;
+    u8 *Distances = Lengths;
+    BufferBits(BitReader, 14);
+    u32 LiteralLength = ConsumeBits(BitReader, 5) + 257;
+    u32 DistanceLength = ConsumeBits(BitReader, 5) + 1;
+    u8 CodeLength = (u8)ConsumeBits(BitReader, 4) + 4;
+    Distances += LiteralLength;
+    
+    for(u8 i = 0; i < CodeLength; i++)
+    {
+        BufferBits(BitReader, 3);
+        Lengths[DEFLATE_ORDER[i]] = (u8)ConsumeBits(BitReader, 3);
+    }
+    for(u8 i = CodeLength; i < 19; i++)
+    {
+        Lengths[DEFLATE_ORDER[i]] = 0;
+    }
+    if(!PopulateDictionary(Buffers->LiteralDictionary, 1 << DEFLATE_CODE_LENGTH_ROOT_BITS,
+                           DEFLATE_CODE_LENGTH_ROOT_BITS, Buffers->SortingBuffer, Lengths, 19))
+    {
+        return("The code length table is invalid.");
+    }
+    
+    u32 CodeCount = LiteralLength + DistanceLength;
+    u32 n = 0;
+    while(n < CodeCount)
+    {
+        BufferBits(BitReader, 7);
+        deflate_code Code = DecodeSymbol(BitReader, Buffers->LiteralDictionary, DEFLATE_CODE_LENGTH_ROOT_BITS);
+        
+        if(Code.Value < 16)
+        {
+            Lengths[n++] = (u8)Code.Value;
+        }
+        else
+        {
+            u8 RepeatValue;
+            u32 Repeats = 0;
+            if(Code.Value == 16)
+            {
+                if(n == 0)
+                {
+                    return("The compressed dynamic talbe started with an invalid code.");
+                }
+                BufferBits(BitReader, 2);
+                RepeatValue = Lengths[n - 1];
+                Repeats = ConsumeBits(BitReader, 2) + 3;
+            }
+            else if(Code.Value == 17)
+            {
+                BufferBits(BitReader, 3);
+                RepeatValue = 0;
+                Repeats = ConsumeBits(BitReader, 3) + 3;
+            }
+            else if(Code.Value == 18)
+            {
+                BufferBits(BitReader, 7);
+                RepeatValue = 0;
+                Repeats = ConsumeBits(BitReader, 7) + 11;
+            }
+            else
+            {
+                return("The compressed dynamic talbe contains an invalid code.");
+            }
+            
+            if(n + Repeats > CodeCount)
+            {
+                return("The compressed dynamic talbe overflows the lengths.");
+            }
+            while(Repeats--)
+            {
+                Lengths[n++] = RepeatValue;
+            }
+        }
+    }
+    
+    if(Lengths[256] == 0)
+    {
+        return("The dynamic table is missing end of block code.");
+    }
+    
+    if(RequireCompleteCodes && (!IsCompleteCode(Lengths, LiteralLength) || !IsCompleteCode(Distances, DistanceLength)))
+    {
+        return("The Huffman tables are incomplete.");
+    }
+    if(!PopulateDictionary(Buffers->LiteralDictionary, DEFLATE_LITERAL_DICTIONARY_SIZE, DEFLATE_LITERAL_ROOT_BITS,
+                           Buffers->SortingBuffer, Lengths, LiteralLength) ||
+       !PopulateDictionary(Buffers->DistanceDictionary, DEFLATE_DISTANCE_DICTIONARY_SIZE, DEFLATE_DISTANCE_ROOT_BITS,
+                           Buffers->SortingBuffer, Distances, DistanceLength))
+    {
+        return("The Huffman table lengths are invalid.");
+    }
+    *LiteralDictionary  = Buffers->LiteralDictionary;
+    *DistanceDictionary = Buffers->DistanceDictionary;
+    return(0);
+}
+
+// Returns an error message, or 0 once the stream or the rows of the scanline state are complete.
+// Without ZlibHeader, the spans start with a raw deflate block.
+static char *
+Inflate(png_data_span *Spans, u32 SpanCount, png_decoding_buffers *Buffers, u64 WindowSize,
+        png_scanline_state *Scanlines, b32 ZlibHeader)
+{
+    png_inflate_window Window = {};
+    Window.Start      = Buffers->DeflateBuffer;
+    Window.End        = Window.Start + WindowSize;
+    Window.Unfiltered = Window.Start;
+    u8 *To = Window.Start;
+    
+    deflate_code *LiteralDictionary  = 0;
+    deflate_code *DistanceDictionary = 0;
+    
+    png_bit_reader BitReader = {};
+    BitReader.NextSpan    = Spans;
+    BitReader.SpansEnd    = Spans + SpanCount;
+    BitReader.CheckedSpan = Spans;
+    
+    if(ZlibHeader)
+    {
+        BufferBits(&BitReader, 16);
+        u32 DictionaryPresent = ConsumeBits(&BitReader, 16) & 0x2000;
+        if(DictionaryPresent)
+        {
+            BufferBits(&BitReader, 32);
+            DropBits(&BitReader, 32);
+        }
+    }
+    
+    b32 LastBlock = false;
+    while(!LastBlock)
+    {
+        if(!FlushWindow(&Window, Scanlines, &To, 0))
+        {
+            return(Window.Error);
+        }
+        if(Scanlines->Verify)
+        {
+            UpdateSpanCRCs(&BitReader, false);
+        }
+        if(Scanlines->Finished)
+        {
+            break;
+        }
+        
+        BufferBits(&BitReader, 3);
+        LastBlock = ConsumeBits(&BitReader, 1);
+        u32 CompressionType = ConsumeBits(&BitReader,2);
+        switch(CompressionType)
+        {
+            case 0://Raw data block
+            {
+                FlushByte(&BitReader);
+                BufferBits(&BitReader, 32);
+                u16 Length = (u16)ConsumeBits(&BitReader, 16);
+                u16 LengthInverse = (u16)ConsumeBits(&BitReader, 16);
+                if(Length != (LengthInverse ^ 0xffff))
+                {
+                    return("Invalid raw data block length.");
+                }
+                while(Length > 0)
+                {
+                    if(To >= Window.End && !FlushWindow(&Window, Scanlines, &To, 1))
+                    {
+                        return(Window.Error);
+                    }
+                    u32 CopyLength = Length;
+                    if(CopyLength > (u64)(Window.End - To))
+                    {
+                        CopyLength = (u32)(Window.End - To);
+                    }
+                    CopyBytes(&BitReader, To, CopyLength);
+                    To += CopyLength;
+                    Length -= (u16)CopyLength;
+                }
+            } break;
+            
+            case 3:
+            {
+                return("Invalid compression type used in the deflate compression.");
+            } break;
+            
+            default://1 or 2
+            {
+                char *Error = ReadHuffmanTables(&BitReader, Buffers, CompressionType, false,
+                                                &LiteralDictionary, &DistanceDictionary);
+                if(Error)
+                {
+                    return(Error);
+                }
+                
+                deflate_code Code = {};
+                while(Code.Value != 256)
+                {
+                    RefillBits(&BitReader);
+                    Code = DecodeSymbol(&BitReader, LiteralDictionary, DEFLATE_LITERAL_ROOT_BITS);
+                    if(Code.Value < 256)
+                    {
+                        if(To >= Window.End && !FlushWindow(&Window, Scanlines, &To, 1))
+                        {
+                            return(Window.Error);
+                        }
+                        *(To++) = (u8)Code.Value;
+                    }
+                    else if(Code.Value > 256)
+                    {
+                        u16 LengthCode = Code.Value - 257;
+                        if(LengthCode >= 29)
+                        {
+                            return("Invalid length code used in the deflate compression.");
+                        }
+                        u8 ExtraBits = DEFLATE_LENGTH_BITS[LengthCode];
+                        u32 BytesToCopy = ConsumeBits(&BitReader, ExtraBits) + DEFLATE_LENGTH_ADD[LengthCode];
+                        
+                        deflate_code DistanceCode = DecodeSymbol(&BitReader, DistanceDictionary, DEFLATE_DISTANCE_ROOT_BITS);
+                        if(DistanceCode.Value >= 30)
+                        {
+                            return("Invalid distance code used in the deflate compression.");
+                        }
+                        ExtraBits = DEFLATE_DISTANCE_BITS[DistanceCode.Value];
+                        u32 Distance = ConsumeBits(&BitReader, ExtraBits) + DEFLATE_DISTANCE_ADD[DistanceCode.Value];
+                        if(To + BytesToCopy > Window.End && !FlushWindow(&Window, Scanlines, &To, BytesToCopy))
+                        {
+                            return(Window.Error);
+                        }
+                        if(Distance > (u64)(To - Window.Start))
+                        {
+                            return("The distance code points in front of the decoded data stream.");
+                        }
+                        CopyMatch(To, Distance, BytesToCopy);
+                        To += BytesToCopy;
+                    }
+                }
+            } break;//End of compression type 1 and 2
+        }
+    }
     
-    u32 ChunkLength = SwapEndian(Chunk->Length);
-    u8 *ChunkDataEnd = Chunk->Data + ChunkLength;
-    if(ChunkDataEnd > FileEndpoint)
+    if(!FlushWindow(&Window, Scanlines, &To, 0))
     {
-        ChunkDataEnd = (u8 *)FileEndpoint;
+        return(Window.Error);
     }
-    png_bit_reader BitReader = {};
-    BitReader.NextByte = Chunk->Data + 2;
-    BitReader.SegmentEnd = ChunkDataEnd;
-    BitReader.FileEnd = (u8 *)FileEndpoint;
-    
-    u8 DictionaryPresent = *(Chunk->Data + 1) & 0x20;
-    if(DictionaryPresent)
+    if(Scanlines->Verify)
     {
-        BitReader.NextByte += 4;
+        UpdateSpanCRCs(&BitReader, true);
     }
+    return(0);
+}
+
+// Encoders without compression write the image data as stored blocks only. This hops from block
+// header to block header, which are all byte aligned in such a stream.
+static b32
+IsStoredStream(png_data_span *Spans, u32 SpanCount)
+{
+    png_bit_reader Reader = {};
+    Reader.NextSpan = Spans;
+    Reader.SpansEnd = Spans + SpanCount;
     
-    if(BitReader.NextByte >= BitReader.SegmentEnd)
+    u32 ZlibHeader = ReadSpanBytes(&Reader, 2);
+    if(ZlibHeader & 0x2000)// Preset dictionary.
     {
-        s64 BytesMissing = BitReader.NextByte - BitReader.SegmentEnd;
-        if(!AdvanceDataChunk(&BitReader))
+        return(false);
+    }
+    for(;;)
+    {
+        u32 BlockHeader = ReadSpanBytes(&Reader, 1);
+        u32 Length = ReadSpanBytes(&Reader, 2);
+        u32 LengthInverse = ReadSpanBytes(&Reader, 2);
+        if((BlockHeader & 0x6) || Length != (LengthInverse ^ 0xffff))
         {
-            return;
+            return(false);
+        }
+        SkipSpanBytes(&Reader, Length);
+        if(Reader.ZeroBytes)
+        {
+            return(false);
+        }
+        if(BlockHeader & 0x1)
+        {
+            return(true);
         }
-        BitReader.NextByte += BytesMissing;
     }
+}
+
+// Decodes a stream of stored blocks without a window. Scanlines that lie in one piece inside a block
+// get unfiltered straight from the file, only the ones split by a block or chunk boundary get put
+// together in the ScanlineBuffer.
+static char *
+InflateStored(png_data_span *Spans, u32 SpanCount, u8 *ScanlineBuffer, png_scanline_state *Scanlines)
+{
+    png_bit_reader Reader = {};
+    Reader.NextSpan = Spans;
+    Reader.SpansEnd = Spans + SpanCount;
+    SkipSpanBytes(&Reader, 2);
     
+    u64 Buffered = 0;
     b32 LastBlock = false;
     while(!LastBlock)
     {
+        LastBlock = ReadSpanBytes(&Reader, 1) & 0x1;
+        u32 Length = ReadSpanBytes(&Reader, 2);
+        SkipSpanBytes(&Reader, 2);
+        while(Length > 0)
+        {
+            if(Reader.NextByte >= Reader.SegmentEnd)
+            {
+                if(Reader.NextSpan >= Reader.SpansEnd)
+                {
+                    return("The stored block runs past the image data.");
+                }
+                Reader.NextByte   = Reader.NextSpan->Start;
+                Reader.SegmentEnd = Reader.NextSpan->End;
+                Reader.NextSpan++;
+                continue;
+            }
+            u8 *At = Reader.NextByte;
+            u8 *End = At + Length;
+            if(End > Reader.SegmentEnd)
+            {
+                End = Reader.SegmentEnd;
+            }
+            Length -= (u32)(End - At);
+            Reader.NextByte = End;
+            
+            while(At < End)
+            {
+                if(Scanlines->Finished)
+                {
+                    return("The decoded data stream overflows the image buffer.");
+                }
+                u64 ScanlineLength = Scanlines->ScanlineLength;
+                u8 *Scanline = At;
+                if(Buffered || (u64)(End - At) < ScanlineLength)
+                {
+                    u64 CopyLength = ScanlineLength - Buffered;
+                    if(CopyLength > (u64)(End - At))
+                    {
+                        CopyLength = (u64)(End - At);
+                    }
+                    u8 *To = ScanlineBuffer + Buffered;
+                    for(u64 i = 0; i < CopyLength; i++)
+                    {
+                        To[i] = At[i];
+                    }
+                    At += CopyLength;
+                    Buffered += CopyLength;
+                    if(Buffered < ScanlineLength)
+                    {
+                        break;
+                    }
+                    Scanline = ScanlineBuffer;
+                    Buffered = 0;
+                }
+                else
+                {
+                    At += ScanlineLength;
+                }
+                UnfilterScanline(Scanlines, Scanline);
+                if(Scanlines->Verify)
+                {
+                    Scanlines->Adler = UpdateAdler32(Scanlines->Adler, Scanline, ScanlineLength);
+                }
+            }
+        }
+    }
+    return(0);
+}
+
+// Assigns the spans and rows of every segment from the iDOT hints. Returns false if the hints
+// don't line up with the image rows and the IDAT chunks.
+static b32
+DivideSpans(png_chunk *DivisionChunk, u32 Height, png_data_span *Spans, u32 SpanCount,
+            png_segment_work *Segments, u32 SegmentCount)
+{
+    png_idot_segment *Hints = (png_idot_segment *)(DivisionChunk->Data + 4);
+    u32 NextRow  = 0;
+    u32 NextSpan = 0;
+    for(u32 SegmentIndex = 0; SegmentIndex < SegmentCount; SegmentIndex++)
+    {
+        png_segment_work *Segment = Segments + SegmentIndex;
+        Segment->FirstRow = SwapEndian(Hints[SegmentIndex].FirstRow);
+        Segment->RowCount = SwapEndian(Hints[SegmentIndex].RowCount);
+        if(Segment->FirstRow != NextRow || Segment->RowCount == 0 || Segment->RowCount > Height - NextRow)
+        {
+            return(false);
+        }
+        NextRow += Segment->RowCount;
+        
+        png_chunk *FirstChunk = (png_chunk *)((u8 *)DivisionChunk + SwapEndian(Hints[SegmentIndex].Offset));
+        if(SegmentIndex > 0)
+        {
+            while(NextSpan < SpanCount && Spans[NextSpan].Start != FirstChunk->Data)
+            {
+                NextSpan++;
+            }
+            if(NextSpan == SpanCount)
+            {
+                return(false);
+            }
+            Segments[SegmentIndex - 1].SpanCount = NextSpan - (u32)(Segments[SegmentIndex - 1].Spans - Spans);
+        }
+        else if(SpanCount == 0 || Spans[0].Start != FirstChunk->Data)
+        {
+            return(false);
+        }
+        Segment->Spans = Spans + NextSpan;
+        NextSpan++;
+    }
+    Segments[SegmentCount - 1].SpanCount = SpanCount - (u32)(Segments[SegmentCount - 1].Spans - Spans);
+    
+    return(NextRow == Height);
+}
+
+static void
+DecodePNGSegment(void *Data)
+{
+    png_segment_work *Segment = (png_segment_work *)Data;
+    Segment->Error = Inflate(Segment->Spans, Segment->SpanCount, Segment->Buffers, Segment->WindowSize,
+                             &Segment->Scanlines, Segment->ZlibHeader);
+}
+
+// Unfilters the scanlines as the inflating thread publishes them, and publishes the finished rows in turn.
+static void
+UnfilterPipelinedRows(void *Data)
+{
+    png_pipeline *Pipeline = (png_pipeline *)Data;
+    png_scanline_state *Scanlines = Pipeline->Scanlines;
+    u64 Unfiltered = 0;
+    for(;;)
+    {
+        // Sleeps until the next scanline is decoded or the inflating thread is done.
+        u64 Published = WaitForCounter(&Pipeline->BytesDecoded, Unfiltered + Scanlines->ScanlineLength);
+        u64 Decoded = Published & ~PNG_INFLATE_DONE;
+        u64 WindowStart = Pipeline->WindowStart;
+        while(!Scanlines->Finished && Decoded - Unfiltered >= Scanlines->ScanlineLength)
+        {
+            u8 *Scanline = Pipeline->Stream + (Unfiltered - WindowStart);
+            u64 ScanlineLength = Scanlines->ScanlineLength;
+            UnfilterScanline(Scanlines, Scanline);
+            if(Scanlines->Verify)
+            {
+                Scanlines->Adler = UpdateAdler32(Scanlines->Adler, Scanline, ScanlineLength);
+            }
+            Unfiltered += ScanlineLength;
+            if(!Scanlines->Interlaced)
+            {
+                SignalCounter(&Pipeline->RowsDone, Scanlines->Y);
+            }
+            Pipeline->BytesUnfiltered = Unfiltered;
+            SignalCounter(&Pipeline->ScanlineEnd,
+                          (Scanlines->Finished) ? U64Max : Unfiltered + Scanlines->ScanlineLength);
+        }
+        if(Scanlines->Finished || (Published & PNG_INFLATE_DONE))
+        {
+            break;
+        }
+    }
+    
+    // Interlaced rows are only done after the last pass. Rows the stream didn't reach stay zero.
+    SignalCounter(&Pipeline->ScanlineEnd, U64Max);
+    SignalCounter(&Pipeline->RowsDone, Scanlines->Height);
+}
+
+// The window of the pipelined decode holds a few chunks of the stream on top of the usual window.
+static u64
+PipelineWindowSize(u32 Width, u32 Height, u32 BitsPerPixel, b32 Interlaced)
+{
+    u64 StreamSize = DecodedDataSize(Width, Height, BitsPerPixel, Interlaced);
+    u64 WindowSize = InflateWindowSize(Width, Height, BitsPerPixel, Interlaced) +
+        (PNG_PIPELINE_CHUNKS - 1) * PNG_STREAM_CHUNK_SIZE;
+    if(WindowSize > StreamSize)
+    {
+        WindowSize = StreamSize;
+    }
+    return(WindowSize);
+}
+
+// What DecodePNGPipelined requests, or zero if it decodes on the calling thread alone.
+static u64
+PipelinedBufferSize(u32 Width, u32 Height, u32 BitsPerPixel, b32 Interlaced)
+{
+    if(WorkerThreadCount() == 0)
+    {
+        return(0);
+    }
+    return(sizeof(png_decoding_buffers) - 1 + PipelineWindowSize(Width, Height, BitsPerPixel, Interlaced) +
+           DEFLATE_COPY_PADDING);
+}
+
+// Inflates on the calling thread, while the work queue unfilters and converts the rows behind it. The window
+// holds a few chunks of the stream on top of the 32 KB for back-references, so the inflating thread only waits
+// when the unfiltering falls that far behind. Returns false without decoding, if there are no worker threads
+// or no memory for the window.
+static b32
+DecodePNGPipelined(png_segment_work *Segment, image_conversion *Conversion, u8 *Converted)
+{
+    png_scanline_state *Scanlines = &Segment->Scanlines;
+    u64 StreamSize = DecodedDataSize(Scanlines->Width, Scanlines->Height, Scanlines->BitsPerPixel,
+                                     Scanlines->Interlaced);
+    if(WorkerThreadCount() == 0)
+    {
+        return(false);
+    }
+    u64 WindowSize = PipelineWindowSize(Scanlines->Width, Scanlines->Height, Scanlines->BitsPerPixel,
+                                        Scanlines->Interlaced);
+    png_decoding_buffers *Buffers = (png_decoding_buffers *)RequestImageBuffer(sizeof(png_decoding_buffers) - 1 +
+                                                                               WindowSize + DEFLATE_COPY_PADDING);
+    if(!Buffers)
+    {
+        return(false);
+    }
+    
+    png_pipeline Pipeline = {};
+    Pipeline.Stream      = Buffers->DeflateBuffer;
+    Pipeline.StreamSize  = StreamSize;
+    Pipeline.ScanlineEnd = Scanlines->ScanlineLength;
+    Pipeline.Scanlines   = Scanlines;
+    
+    // The inflating thread gets its own scanline state, which only tracks the decoded size.
+    png_scanline_state Progress = *Scanlines;
+    Progress.Pipeline = &Pipeline;
+    
+    AddWorkEntry(UnfilterPipelinedRows, &Pipeline);
+    // Bands of finished rows get converted behind the unfiltering.
+    conversion_band Bands[CONVERSION_BANDS];
+    if(Conversion)
+    {
+        u32 BandCount = SplitConversionBands(Bands, Conversion, Scanlines->Image, Converted,
+                                             0, Scanlines->Height, &Pipeline.RowsDone);
+        for(u32 BandIndex = 0; BandIndex < BandCount; BandIndex++)
+        {
+            AddWorkEntry(ConvertBand, Bands + BandIndex);
+        }
+    }
+    
+    Segment->Error = Inflate(Segment->Spans, Segment->SpanCount, Buffers, WindowSize, &Progress,
+                             Segment->ZlibHeader);
+    // Also wakes the unfiltering, if the stream ended in front of the scanline it waits for.
+    SignalCounter(&Pipeline.BytesDecoded, Pipeline.BytesDecoded | PNG_INFLATE_DONE);
+    CompleteAllWork();
+    
+    FreeImageBuffer(Buffers);
+    return(true);
+}
+
+static u64
+ReaderBitPosition(png_bit_reader *Reader, u8 *Data)
+{
+    return((u64)(Reader->NextByte - Data + Reader->ZeroBytes) * 8 - Reader->StoredBits);
+}
+
+// Quick test for the header of a non-final block with dynamic tables, before decoding it. At needs 16 readable bytes.
+static b32
+IsPlausibleBlockHeader(u8 *At, u32 Shift)
+{
+    u64 Low  = *(u64 *)At;
+    u64 High = *(u64 *)(At + 8);
+    if(Shift)
+    {
+        Low    = (Low >> Shift) | (High << (64 - Shift));
+        High >>= Shift;
+    }
+    if((Low & 7) != 4 || ((Low >> 3) & 31) > 29 || ((Low >> 8) & 31) > 29)
+    {
+        return(false);
+    }
+    
+    // The code length code has to be complete.
+    u32 CodeLength = (u32)((Low >> 13) & 15) + 4;
+    u32 Space = 0;
+    for(u32 i = 0; i < CodeLength; i++)
+    {
+        u32 BitIndex = 17 + 3 * i;
+        u64 Bits = (BitIndex < 64) ? (Low >> BitIndex) | (High << (64 - BitIndex)) : (High >> (BitIndex - 64));
+        u32 Length = (u32)(Bits & 7);
+        if(Length)
+        {
+            Space += 128 >> Length;
+        }
+    }
+    return(Space == 128);
+}
+
+// Points the reader of the chunk at a bit of its data.
+static void
+SeatChunkReader(png_speculative_chunk *Chunk, u64 Bit)
+{
+    png_bit_reader *Reader = &Chunk->Reader;
+    *Reader = {};
+    Reader->NextByte   = Chunk->Data + Bit / 8;
+    Reader->SegmentEnd = Chunk->DataEnd;
+    BufferBits(Reader, 8);
+    DropBits(Reader, (u32)(Bit % 8));
+}
+
+static void
+ResetChunk(png_speculative_chunk *Chunk, u64 Bit)
+{
+    SeatChunkReader(Chunk, Bit);
+    Chunk->To        = (u16 *)Chunk->Buffers->DeflateBuffer;
+    Chunk->Emitted   = Chunk->To;
+    Chunk->Length    = 0;
+    Chunk->LastBlock = false;
+    Chunk->Error     = 0;
+}
+
+// Appends decoded bytes to the stream, which unfilters the complete scanlines and slides the window once it
+// is full. The bytes are either packed or entries without markers.
+static b32
+StoreSpeculativeBytes(png_speculative_output *Output, u8 *Bytes, u16 *Entries, u64 Count)
+{
+    while(Count > 0)
+    {
+        u64 CopyCount = (Count < PNG_STREAM_CHUNK_SIZE) ? Count : PNG_STREAM_CHUNK_SIZE;
+        if(!FlushWindow(&Output->Window, Output->Scanlines, &Output->To, CopyCount))
+        {
+            return(false);
+        }
+        
+        u8 *To = Output->To;
+        u8 *ToEnd = To + CopyCount;
+        if(Entries)
+        {
+            while(ToEnd - To >= 16)
+            {
+                __m128i Low  = _mm_loadu_si128((__m128i *)Entries);
+                __m128i High = _mm_loadu_si128((__m128i *)(Entries + 8));
+                _mm_storeu_si128((__m128i *)To, _mm_packus_epi16(Low, High));
+                Entries += 16;
+                To += 16;
+            }
+            while(To < ToEnd)
+            {
+                *(To++) = (u8)*(Entries++);
+            }
+        }
+        else
+        {
+            while(ToEnd - To >= 16)
+            {
+                _mm_storeu_si128((__m128i *)To, _mm_loadu_si128((__m128i *)Bytes));
+                Bytes += 16;
+                To += 16;
+            }
+            while(To < ToEnd)
+            {
+                *(To++) = *(Bytes++);
+            }
+        }
+        Output->To    = To;
+        Output->Size += CopyCount;
+        Count -= CopyCount;
+    }
+    return(true);
+}
+
+// Appends entries to the chunk. Once the bytes in front of the chunk are known, they go straight into the
+// decoded stream instead.
+static b32
+EmitEntries(png_speculative_chunk *Chunk, u16 *From, u64 Count)
+{
+    if(Chunk->Output)
+    {
+        if(!StoreSpeculativeBytes(Chunk->Output, 0, From, Count))
+        {
+            Chunk->Error = Chunk->Output->Window.Error;
+            if(!Chunk->Error)
+            {
+                Chunk->Error = "The decoded data stream overflows the image buffer.";
+            }
+            return(false);
+        }
+        return(true);
+    }
+    if(Count > Chunk->Capacity - Chunk->Length)
+    {
+        // Only drops the chunk, the chunk in front of it decodes this part instead.
+        Chunk->Error = "The chunk decodes to more entries than it has room for.";
+        return(false);
+    }
+    
+    u16 *Destination = Chunk->Entries + Chunk->Length;
+    u16 *CopyEnd = From + Count;
+    while(CopyEnd - From >= 8)
+    {
+        _mm_storeu_si128((__m128i *)Destination, _mm_loadu_si128((__m128i *)From));
+        From += 8;
+        Destination += 8;
+    }
+    while(From < CopyEnd)
+    {
+        *(Destination++) = *(From++);
+    }
+    Chunk->Length += Count;
+    return(true);
+}
+
+// Stores the new entries and keeps the last DEFLATE_WINDOW_SIZE entries for back-references.
+static b32
+SlideChunkWindow(png_speculative_chunk *Chunk, png_bit_reader *Reader, u16 **To)
+{
+    if(Reader->ZeroBytes * 8 > Reader->StoredBits)
+    {
+        Chunk->Error = "The deflate stream ends in the middle of a block.";
+        return(false);
+    }
+    if(!EmitEntries(Chunk, Chunk->Emitted, *To - Chunk->Emitted))
+    {
+        return(false);
+    }
+    
+    // The window is always full here, so the kept entries don't overlap their destination.
+    u16 *Window = (u16 *)Chunk->Buffers->DeflateBuffer;
+    u16 *From = *To - DEFLATE_WINDOW_SIZE;
+    for(u32 i = 0; i < DEFLATE_WINDOW_SIZE; i += 8)
+    {
+        _mm_storeu_si128((__m128i *)(Window + i), _mm_loadu_si128((__m128i *)(From + i)));
+    }
+    *To = Window + DEFLATE_WINDOW_SIZE;
+    Chunk->Emitted = *To;
+    return(true);
+}
+
+// Decodes whole blocks into entries until a block starts at or behind StopBit, or the last block ends.
+// Calling it again with a later StopBit continues where it stopped.
+static void
+InflateChunk(png_speculative_chunk *Chunk)
+{
+    png_bit_reader BitReader = Chunk->Reader;
+    png_decoding_buffers *Buffers = Chunk->Buffers;
+    deflate_code *LiteralDictionary  = 0;
+    deflate_code *DistanceDictionary = 0;
+    u16 *Window    = (u16 *)Buffers->DeflateBuffer;
+    u16 *WindowEnd = Window + PNG_SPECULATIVE_WINDOW_ENTRIES;
+    u16 *To        = Chunk->To;
+    
+    while(!Chunk->Error)
+    {
+        u64 Bit = ReaderBitPosition(&BitReader, Chunk->Data);
+        if(Bit > (u64)(Chunk->DataEnd - Chunk->Data) * 8)
+        {
+            // Decoded zeros behind the data, which can look like valid blocks.
+            Chunk->Error = "The deflate stream ends in the middle of a block.";
+            break;
+        }
+        if(Chunk->LastBlock || Bit >= Chunk->StopBit)
+        {
+            Chunk->EndBit = Bit;
+            break;
+        }
+        
         BufferBits(&BitReader, 3);
-        LastBlock = ConsumeBits(&BitReader, 1);
-        u32 CompressionType = ConsumeBits(&BitReader,2);
-        switch(CompressionType)
+        Chunk->LastBlock = ConsumeBits(&BitReader, 1);
+        u32 CompressionType = ConsumeBits(&BitReader, 2);
+        if(CompressionType == 0)
         {
-            case 0://Raw data block
+            FlushByte(&BitReader);
+            BufferBits(&BitReader, 32);
+            u32 Length = ConsumeBits(&BitReader, 16);
+            if(Length != (ConsumeBits(&BitReader, 16) ^ 0xffff))
             {
-                FlushByte(&BitReader);
-                BufferBits(&BitReader, 32);
-                u16 Length = (u16)ConsumeBits(&BitReader, 16);
-                u16 LengthInverse = (u16)ConsumeBits(&BitReader, 16);
-                if(Length != (LengthInverse ^ 0xffff))
+                Chunk->Error = "Invalid raw data block length.";
+            }
+            while(!Chunk->Error && Length > 0)
+            {
+                if(To >= WindowEnd && !SlideChunkWindow(Chunk, &BitReader, &To))
                 {
-                    LogError("Invalid raw data block length.", "PNG Reader");
-                    return;
+                    break;
                 }
-                u8 *CopyEnd = To + Length;
-                if(CopyEnd > BufferEnd)
+                u32 CopyLength = Length;
+                if(CopyLength > (u64)(WindowEnd - To))
                 {
-                    LogError("The decoded data stream overflows the image buffer.", "PNG Reader");
-                    return;
+                    CopyLength = (u32)(WindowEnd - To);
                 }
-                CopyBytes(&BitReader, To, Length);
-                To = CopyEnd;
-            } break;
-            
-            case 3:
-            {
-                LogError("Invalid compression type used in the deflate compression.", "PNG Reader");
-                return;
-            } break;
+                CopyBytesToEntries(&BitReader, To, CopyLength);
+                To += CopyLength;
+                Length -= CopyLength;
+            }
+        }
+        else if(CompressionType == 3)
+        {
+            Chunk->Error = "Invalid compression type used in the deflate compression.";
+        }
+        else
+        {
+            Chunk->Error = ReadHuffmanTables(&BitReader, Buffers, CompressionType, Chunk->Probing,
+                                             &LiteralDictionary, &DistanceDictionary);
             
-            default://1 or 2
+            deflate_code Code = {};
+            while(!Chunk->Error && Code.Value != 256)
             {
-                u8 *Lengths = Buffers->Lengths;
-                u8 *Distances = Lengths;
-                u32 LiteralLength;
-                u32 DistanceLength;
-                
-                if(CompressionType == 1)//Fixed table
+                RefillBits(&BitReader);
+                Code = DecodeSymbol(&BitReader, LiteralDictionary, DEFLATE_LITERAL_ROOT_BITS);
+                if(Code.Value < 256)
                 {
-                    LiteralLength = 288;
-                    DistanceLength = 32;
-                    Distances += LiteralLength;
-                    u32 n = 0;
-                    while(n < 144)
-                        Lengths[n++] = 8;
-                    while(n < 256)
-                        Lengths[n++] = 9;
-                    while(n < 280)
-                        Lengths[n++] = 7;
-                    while(n < 288)
-                        Lengths[n++] = 8;
-                    while(n < 320)
-                        Lengths[n++] = 5;
+                    if(To >= WindowEnd && !SlideChunkWindow(Chunk, &BitReader, &To))
+                    {
+                        break;
+                    }
+                    *(To++) = Code.Value;
                 }
-                else//Dynamic table
+                else if(Code.Value > 256)
                 {
-                    BufferBits(&BitReader, 14);
-                    LiteralLength = ConsumeBits(&BitReader, 5) + 257;
-                    DistanceLength = ConsumeBits(&BitReader, 5) + 1;
-                    u8 CodeLength = (u8)ConsumeBits(&BitReader, 4) + 4;
-                    Distances += LiteralLength;
+                    u16 LengthCode = Code.Value - 257;
+                    if(LengthCode >= 29)
+                    {
+                        Chunk->Error = "Invalid length code used in the deflate compression.";
+                        break;
+                    }
+                    u8 ExtraBits = DEFLATE_LENGTH_BITS[LengthCode];
+                    u32 Length = ConsumeBits(&BitReader, ExtraBits) + DEFLATE_LENGTH_ADD[LengthCode];
                     
-                    for(u8 i = 0; i < CodeLength; i++)
+                    deflate_code DistanceCode = DecodeSymbol(&BitReader, DistanceDictionary, DEFLATE_DISTANCE_ROOT_BITS);
+                    if(DistanceCode.Value >= 30)
                     {
-                        BufferBits(&BitReader, 3);
-                        Lengths[DEFLATE_ORDER[i]] = (u8)ConsumeBits(&BitReader, 3);
+                        Chunk->Error = "Invalid distance code used in the deflate compression.";
+                        break;
                     }
-                    for(u8 i = CodeLength; i < 19; i++)
+                    ExtraBits = DEFLATE_DISTANCE_BITS[DistanceCode.Value];
+                    u32 Distance = ConsumeBits(&BitReader, ExtraBits) + DEFLATE_DISTANCE_ADD[DistanceCode.Value];
+                    if(To + Length > WindowEnd && !SlideChunkWindow(Chunk, &BitReader, &To))
                     {
-                        Lengths[DEFLATE_ORDER[i]] = 0;
+                        break;
                     }
-                    PopulateDictionary(LiteralDictionary, 1 << 7, Buffers->SortingBuffer, Lengths, 19);
                     
-                    u32 CodeCount = LiteralLength + DistanceLength;
-                    u32 n = 0;
-                    while(n < CodeCount)
+                    if(Distance <= (u64)(To - Window))
                     {
-                        BufferBits(&BitReader, 7);
-                        deflate_code Code = LiteralDictionary[PeekBits(&BitReader, 7)];
-                        DropBits(&BitReader, Code.Length);
-                        
-                        if(Code.Value < 16)
-                        {
-                            Lengths[n++] = (u8)Code.Value;
-                        }
-                        else
-                        {
-                            u8 RepeatValue;
-                            u32 Repeats = 0;
-                            if(Code.Value == 16)
-                            {
-                                if(n == 0)
-                                {
-                                    LogError("The compressed dynamic talbe started with an invalid code.", "PNG Reader");
-                                    return;
-                                }
-                                BufferBits(&BitReader, 2);
-                                RepeatValue = Lengths[n - 1];
-                                Repeats = ConsumeBits(&BitReader, 2) + 3;
-                            }
-                            else if(Code.Value == 17)
-                            {
-                                BufferBits(&BitReader, 3);
-                                RepeatValue = 0;
-                                Repeats = ConsumeBits(&BitReader, 3) + 3;
-                            }
-                            else
-                            {
-                                BufferBits(&BitReader, 7);
-                                RepeatValue = 0;
-                                Repeats = ConsumeBits(&BitReader, 7) + 11;
-                            }
-                            
-                            if(n + Repeats > CodeCount)
-                            {
-                                LogError("The compressed dynamic talbe overflows the lengths.", "PNG Reader");
-                                return;
-                            }
-                            while(Repeats--)
-                            {
-                                Lengths[n++] = RepeatValue;
-                            }
-                        }
+                        CopyMatch((u8 *)To, 2 * Distance, 2 * Length);
                     }
-                    
-                    if(Lengths[256] == 0)
+                    else if(Chunk->Output)
                     {
-                        LogError("The dynamic table is missing end of block code.", "PNG Reader");
-                        return;
+                        // A chunk that decodes into the stream has everything in front of it in its window.
+                        Chunk->Error = "The distance code points in front of the decoded data stream.";
+                        break;
                     }
-                }//End of dynamic table
-                
-                PopulateDictionary(LiteralDictionary, 1 << 15,
-                                   Buffers->SortingBuffer, Lengths, LiteralLength);
-                PopulateDictionary(DistanceDictionary, 1 << 15,
-                                   Buffers->SortingBuffer, Distances, DistanceLength);
-                
-                deflate_code Code = {};
-                while(Code.Value != 256)
-                {
-                    BufferBits(&BitReader, 15);
-                    Code = LiteralDictionary[PeekBits(&BitReader, 15)];
-                    DropBits(&BitReader, Code.Length);
-                    if(Code.Value < 256)
+                    else
                     {
-                        if(To >= BufferEnd)
+                        // The window hasn't slid yet, so the match reaches into the bytes in front of the chunk.
+                        s64 From = (To - Window) - (s64)Distance;
+                        for(u32 i = 0; i < Length; i++, From++)
                         {
-                            LogError("The decoded data stream overflows the image buffer.", "PNG Reader");
-                            return;
+                            To[i] = (From < 0) ? (u16)(PNG_MARKER_BASE + DEFLATE_WINDOW_SIZE + From) : Window[From];
                         }
-                        *(To++) = (u8)Code.Value;
                     }
-                    else if(Code.Value > 256)
+                    To += Length;
+                }
+            }
+        }
+    }
+    
+    if(!Chunk->Error && EmitEntries(Chunk, Chunk->Emitted, To - Chunk->Emitted))
+    {
+        Chunk->Emitted = To;
+    }
+    Chunk->Reader = BitReader;
+    Chunk->To     = To;
+}
+
+static void
+SpeculateChunk(void *Data)
+{
+    png_speculative_chunk *Chunk = (png_speculative_chunk *)Data;
+    u64 StopBit = Chunk->StopBit;
+    if(!Chunk->Found)
+    {
+        u64 SearchEnd = Chunk->SearchBit + PNG_BLOCK_SEARCH_SIZE * 8;
+        if(SearchEnd > StopBit)
+        {
+            SearchEnd = StopBit;
+        }
+        if(SearchEnd > (u64)(Chunk->DataEnd - Chunk->Data - 16) * 8)
+        {
+            SearchEnd = (u64)(Chunk->DataEnd - Chunk->Data - 16) * 8;
+        }
+        for(u64 Bit = Chunk->SearchBit; Bit < SearchEnd; Bit++)
+        {
+            if(IsPlausibleBlockHeader(Chunk->Data + Bit / 8, (u32)(Bit % 8)))
+            {
+                // A block start is only accepted once its block decoded with complete codes.
+                ResetChunk(Chunk, Bit);
+                Chunk->Probing = true;
+                Chunk->StopBit = Bit + 1;
+                InflateChunk(Chunk);
+                Chunk->Probing = false;
+                if(!Chunk->Error)
+                {
+                    Chunk->StartBit = Bit;
+                    Chunk->Found    = true;
+                    break;
+                }
+            }
+        }
+    }
+    
+    Chunk->StopBit = StopBit;
+    if(Chunk->Found)
+    {
+        InflateChunk(Chunk);
+    }
+}
+
+// Writes the entries from First to End of the chunk as bytes to To. Returns false if an entry points in front
+// of the decoded stream.
+static b32
+ResolveEntries(png_speculative_chunk *Chunk, u64 First, u64 End, u8 *To)
+{
+    u16 *Entries = Chunk->Entries + First;
+    u64 Count = End - First;
+    u32 FirstValidMarker = PNG_MARKER_BASE;
+    if(Chunk->Offset < DEFLATE_WINDOW_SIZE)
+    {
+        FirstValidMarker += DEFLATE_WINDOW_SIZE - (u32)Chunk->Offset;
+    }
+    
+    // Most entries are plain bytes, which just get packed. To can be the entries themselves, every entry is
+    // read before its byte gets written.
+    __m128i HighBytes = _mm_set1_epi16((short)0xff00);
+    u64 I = 0;
+    while(I < Count)
+    {
+        while(I + 16 <= Count)
+        {
+            __m128i Low  = _mm_loadu_si128((__m128i *)(Entries + I));
+            __m128i High = _mm_loadu_si128((__m128i *)(Entries + I + 8));
+            __m128i Markers = _mm_and_si128(_mm_or_si128(Low, High), HighBytes);
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(Markers, _mm_setzero_si128())) != 0xffff)
+            {
+                break;
+            }
+            _mm_storeu_si128((__m128i *)(To + I), _mm_packus_epi16(Low, High));
+            I += 16;
+        }
+        
+        u64 ScalarEnd = (I + 16 < Count) ? I + 16 : Count;
+        for(; I < ScalarEnd; I++)
+        {
+            u16 Entry = Entries[I];
+            if(Entry < PNG_MARKER_BASE)
+            {
+                To[I] = (u8)Entry;
+            }
+            else if(Entry >= FirstValidMarker)
+            {
+                To[I] = Chunk->Front[Entry - PNG_MARKER_BASE];
+            }
+            else
+            {
+                return(false);
+            }
+        }
+    }
+    return(true);
+}
+
+// Resolves the chunk in place, in front of the tail that is already resolved.
+static void
+ResolveChunk(void *Data)
+{
+    png_speculative_chunk *Chunk = (png_speculative_chunk *)Data;
+    u64 TailLength = (Chunk->Length < DEFLATE_WINDOW_SIZE) ? Chunk->Length : DEFLATE_WINDOW_SIZE;
+    u64 TailStart = Chunk->Length - TailLength;
+    u8 *Bytes = (u8 *)Chunk->Entries;
+    if(!ResolveEntries(Chunk, 0, TailStart, Bytes))
+    {
+        Chunk->Error = "The distance code points in front of the decoded data stream.";
+        return;
+    }
+    u8 *From = Chunk->Tail + DEFLATE_WINDOW_SIZE - TailLength;
+    for(u64 I = 0; I < TailLength; I++)
+    {
+        Bytes[TailStart + I] = From[I];
+    }
+}
+
+// The chunk continues the decoded stream from here on, with the end of the stream in its window.
+static void
+MakeChunkDirect(png_speculative_chunk *Chunk, png_speculative_output *Output)
+{
+    u64 KeptSize = (Output->Size < DEFLATE_WINDOW_SIZE) ? Output->Size : DEFLATE_WINDOW_SIZE;
+    u16 *Window = (u16 *)Chunk->Buffers->DeflateBuffer;
+    u8 *From = Output->To - KeptSize;
+    for(u64 I = 0; I < KeptSize; I++)
+    {
+        Window[I] = From[I];
+    }
+    Chunk->To      = Window + KeptSize;
+    Chunk->Emitted = Chunk->To;
+    Chunk->Output  = Output;
+}
+
+// Resolves the linked chunks behind the decoded stream and appends them to it. The last 32 KB of every chunk
+// get resolved in order, then the rest of the chunks only depends on bytes that are already known.
+static b32
+StorePendingChunks(png_speculative_output *Output, png_speculative_chunk **Pending, u32 PendingCount)
+{
+    u64 FrontSize = (Output->Size < DEFLATE_WINDOW_SIZE) ? Output->Size : DEFLATE_WINDOW_SIZE;
+    u8 *From = Output->To - FrontSize;
+    for(u64 I = 0; I < FrontSize; I++)
+    {
+        Output->Front[DEFLATE_WINDOW_SIZE - FrontSize + I] = From[I];
+    }
+    
+    u8 *Front = Output->Front;
+    u64 Offset = Output->Size;
+    for(u32 PendingIndex = 0; PendingIndex < PendingCount; PendingIndex++)
+    {
+        png_speculative_chunk *Chunk = Pending[PendingIndex];
+        Chunk->Front  = Front;
+        Chunk->Offset = Offset;
+        
+        // The tail becomes the front of the next chunk, short chunks keep the end of their own front.
+        u64 TailLength = (Chunk->Length < DEFLATE_WINDOW_SIZE) ? Chunk->Length : DEFLATE_WINDOW_SIZE;
+        for(u64 I = TailLength; I < DEFLATE_WINDOW_SIZE; I++)
+        {
+            Chunk->Tail[I - TailLength] = Front[I];
+        }
+        if(!ResolveEntries(Chunk, Chunk->Length - TailLength, Chunk->Length,
+                           Chunk->Tail + DEFLATE_WINDOW_SIZE - TailLength))
+        {
+            return(false);
+        }
+        Front = Chunk->Tail;
+        Offset += Chunk->Length;
+    }
+    
+    for(u32 PendingIndex = 0; PendingIndex < PendingCount; PendingIndex++)
+    {
+        AddWorkEntry(ResolveChunk, Pending[PendingIndex]);
+    }
+    CompleteAllWork();
+    
+    b32 Result = true;
+    for(u32 PendingIndex = 0; Result && PendingIndex < PendingCount; PendingIndex++)
+    {
+        png_speculative_chunk *Chunk = Pending[PendingIndex];
+        Result = (!Chunk->Error && StoreSpeculativeBytes(Output, (u8 *)Chunk->Entries, 0, Chunk->Length));
+    }
+    return(Result);
+}
+
+// Copies Size bytes of the data spans to To, starting Offset bytes into them. Returns the number of bytes copied.
+static u64
+GatherSpans(png_data_span *Spans, u32 SpanCount, u64 Offset, u8 *To, u64 Size)
+{
+    u8 *Destination = To;
+    u8 *DestinationEnd = To + Size;
+    for(u32 SpanIndex = 0; SpanIndex < SpanCount && Destination < DestinationEnd; SpanIndex++)
+    {
+        u8 *From = Spans[SpanIndex].Start;
+        u64 SpanSize = (u64)(Spans[SpanIndex].End - From);
+        if(Offset >= SpanSize)
+        {
+            Offset -= SpanSize;
+            continue;
+        }
+        From += Offset;
+        Offset = 0;
+        
+        u8 *FromEnd = Spans[SpanIndex].End;
+        if((u64)(FromEnd - From) > (u64)(DestinationEnd - Destination))
+        {
+            FromEnd = From + (DestinationEnd - Destination);
+        }
+        while(FromEnd - From >= 16)
+        {
+            _mm_storeu_si128((__m128i *)Destination, _mm_loadu_si128((__m128i *)From));
+            From += 16;
+            Destination += 16;
+        }
+        while(From < FromEnd)
+        {
+            *(Destination++) = *(From++);
+        }
+    }
+    return((u64)(Destination - To));
+}
+
+// Lays out the buffer of the speculative inflate, which takes no more memory than the image. Returns false if
+// the stream isn't worth splitting, it then gets decoded through the window.
+static b32
+PlanSpeculativeInflate(png_speculative_plan *Plan, u32 Width, u32 Height, u32 BitsPerPixel, b32 Interlaced,
+                       u64 CompressedSize, u32 SpanCount)
+{
+    // Without other threads the detour through the entries only costs time. Streams that barely compress
+    // are mostly stored blocks, which the search can't find and which inflate at memory speed anyway.
+    u32 ThreadCount = WorkerThreadCount() + 1;
+    u64 DecodedSize = DecodedDataSize(Width, Height, BitsPerPixel, Interlaced);
+    if(ThreadCount < 2 || CompressedSize < PNG_SPECULATIVE_THRESHOLD ||
+       DecodedSize < CompressedSize + CompressedSize / 8)
+    {
+        return(false);
+    }
+    
+    u64 Budget = ((u64)BitsPerPixel * (u64)Width + 7) / 8 * (u64)Height;
+    r64 Ratio = (r64)CompressedSize / (r64)DecodedSize;
+    *Plan = {};
+    Plan->WindowSize  = InflateWindowSize(Width, Height, BitsPerPixel, Interlaced);
+    Plan->DecoderSize = AlignPow2(sizeof(png_decoding_buffers) - 1 + PNG_SPECULATIVE_WINDOW_ENTRIES * sizeof(u16) +
+                                  DEFLATE_COPY_PADDING, 16);
+    u32 ChunkCount = 2 * ThreadCount;
+    if(ChunkCount > PNG_MAX_SPECULATIVE_CHUNKS)
+    {
+        ChunkCount = PNG_MAX_SPECULATIVE_CHUNKS;
+    }
+    
+    // Fewer chunks per wave get more room each, until they are too small to be worth linking.
+    for(; ChunkCount >= 2; ChunkCount--)
+    {
+        u64 FixedSize = AlignPow2(Plan->WindowSize, 16) + ChunkCount * (DEFLATE_WINDOW_SIZE + Plan->DecoderSize);
+        if(SpanCount > 1)
+        {
+            FixedSize += PNG_SPECULATIVE_OVERLAP + 16;
+        }
+        if(FixedSize >= Budget)
+        {
+            continue;
+        }
+        
+        // Every chunk but the first needs an entry per decoded byte, with room for chunks that compress twice
+        // as well as the whole stream. Data split over several IDAT chunks gets gathered for every wave.
+        r64 BytesPerEntry = 2.0 * (r64)(ChunkCount - 1);
+        if(SpanCount > 1)
+        {
+            BytesPerEntry += (r64)ChunkCount * Ratio / 2.0;
+        }
+        u64 Capacity  = (u64)((r64)(Budget - FixedSize) / BytesPerEntry);
+        u64 ChunkSize = (u64)((r64)Capacity * Ratio / 2.0);
+        u64 EvenSize  = (CompressedSize + ChunkCount - 1) / ChunkCount;
+        if(ChunkSize > EvenSize)
+        {
+            ChunkSize = EvenSize;
+            Capacity  = (u64)(2.0 * (r64)ChunkSize / Ratio);
+        }
+        Capacity &= ~(u64)7;
+        if(ChunkSize < PNG_SPECULATIVE_MIN_CHUNK)
+        {
+            continue;
+        }
+        
+        Plan->ChunkCount    = ChunkCount;
+        Plan->ChunkSize     = ChunkSize;
+        Plan->Capacity      = Capacity;
+        Plan->DataSize      = (SpanCount > 1) ? ChunkCount * ChunkSize + PNG_SPECULATIVE_OVERLAP + 16 : 0;
+        Plan->FrontOffset   = AlignPow2(Plan->WindowSize, 16);
+        Plan->DecoderOffset = Plan->FrontOffset + ChunkCount * DEFLATE_WINDOW_SIZE;
+        Plan->EntryOffset   = Plan->DecoderOffset + ChunkCount * Plan->DecoderSize;
+        Plan->DataOffset    = Plan->EntryOffset + (ChunkCount - 1) * Capacity * sizeof(u16);
+        Plan->BufferSize    = Plan->DataOffset + Plan->DataSize;
+        return(true);
+    }
+    return(false);
+}
+
+// Inflates a large stream in waves of chunks on the work queue, unfiltering the decoded stream behind them.
+// Returns false with the image and the scanline state as they were if the chunks can't be linked up, so the
+// stream can be decoded serially.
+static b32
+InflateSpeculatively(png_data_span *Spans, u32 SpanCount, u64 CompressedSize, png_scanline_state *Scanlines)
+{
+    png_speculative_plan Plan;
+    if(!PlanSpeculativeInflate(&Plan, Scanlines->Width, Scanlines->Height, Scanlines->BitsPerPixel,
+                               Scanlines->Interlaced, CompressedSize, SpanCount))
+    {
+        return(false);
+    }
+    u8 *Buffer = (u8 *)RequestImageBuffer(Plan.BufferSize);
+    if(!Buffer)
+    {
+        return(false);
+    }
+    
+    png_scanline_state Restart = *Scanlines;
+    png_speculative_output Output = {};
+    Output.Window.Start      = Buffer;
+    Output.Window.End        = Buffer + Plan.WindowSize;
+    Output.Window.Unfiltered = Buffer;
+    Output.To        = Buffer;
+    Output.Front     = Buffer + Plan.FrontOffset;
+    Output.Scanlines = Scanlines;
+    
+    png_speculative_chunk Chunks[PNG_MAX_SPECULATIVE_CHUNKS] = {};
+    for(u32 ChunkIndex = 0; ChunkIndex < Plan.ChunkCount; ChunkIndex++)
+    {
+        Chunks[ChunkIndex].Buffers = (png_decoding_buffers *)(Buffer + Plan.DecoderOffset +
+                                                              ChunkIndex * Plan.DecoderSize);
+    }
+    
+    // Every wave starts with the chunk that continues the stream, the others speculate on the data behind it.
+    png_speculative_chunk *Active = Chunks;
+    u64 DataStart = 0;// Position of the data of the wave in the compressed stream.
+    u64 FirstBit  = 0;
+    b32 Result = true;
+    b32 Done   = false;
+    for(u32 Wave = 0; Result && !Done; Wave++)
+    {
+        u64 WaveSize = Plan.ChunkCount * Plan.ChunkSize;
+        u64 RemainingSize = CompressedSize - DataStart;
+        b32 LastWave = (WaveSize >= RemainingSize);
+        u32 ChunkCount = Plan.ChunkCount;
+        if(LastWave)
+        {
+            ChunkCount = (u32)((RemainingSize + Plan.ChunkSize - 1) / Plan.ChunkSize);
+            if(ChunkCount == 0)
+            {
+                ChunkCount = 1;
+            }
+        }
+        
+        // The chunks read the data as a single span, so it gets gathered if it is split over several IDAT chunks.
+        u8 *Data    = Spans[0].Start + DataStart;
+        u8 *DataEnd = Spans[0].End;
+        if(SpanCount > 1)
+        {
+            Data    = Buffer + Plan.DataOffset;
+            DataEnd = Data + GatherSpans(Spans, SpanCount, DataStart, Data, WaveSize + PNG_SPECULATIVE_OVERLAP);
+        }
+        
+        if(Active != Chunks)
+        {
+            // The chunk moves to the first slot along with its decoder.
+            png_decoding_buffers *Buffers = Chunks->Buffers;
+            *Chunks = *Active;
+            Active->Buffers = Buffers;
+            Active = Chunks;
+        }
+        Active->Data    = Data;
+        Active->DataEnd = DataEnd;
+        if(Wave == 0)
+        {
+            // The first chunk starts behind the zlib header, with nothing in front of it.
+            ResetChunk(Active, 0);
+            BufferBits(&Active->Reader, 16);
+            u32 DictionaryPresent = ConsumeBits(&Active->Reader, 16) & 0x2000;
+            if(DictionaryPresent)
+            {
+                BufferBits(&Active->Reader, 32);
+                DropBits(&Active->Reader, 32);
+            }
+            FirstBit = ReaderBitPosition(&Active->Reader, Data);
+            Active->StartBit = FirstBit;
+            Active->Found    = true;
+            Active->Output   = &Output;
+        }
+        else
+        {
+            SeatChunkReader(Active, FirstBit);
+        }
+        
+        u64 ChunkBits = Plan.ChunkSize * 8;
+        Active->StopBit = (ChunkCount > 1 || !LastWave) ? FirstBit + ChunkBits : U64Max;
+        for(u32 ChunkIndex = 1; ChunkIndex < ChunkCount; ChunkIndex++)
+        {
+            png_speculative_chunk *Chunk = Chunks + ChunkIndex;
+            png_decoding_buffers *Buffers = Chunk->Buffers;
+            *Chunk = {};
+            Chunk->Data      = Data;
+            Chunk->DataEnd   = DataEnd;
+            Chunk->Buffers   = Buffers;
+            Chunk->Entries   = (u16 *)(Buffer + Plan.EntryOffset) + (ChunkIndex - 1) * Plan.Capacity;
+            Chunk->Capacity  = Plan.Capacity;
+            Chunk->Tail      = Buffer + Plan.FrontOffset + ChunkIndex * DEFLATE_WINDOW_SIZE;
+            Chunk->SearchBit = FirstBit + ChunkIndex * ChunkBits;
+            Chunk->StopBit   = (ChunkIndex + 1 < ChunkCount || !LastWave) ? Chunk->SearchBit + ChunkBits : U64Max;
+        }
+        for(u32 ChunkIndex = 0; ChunkIndex < ChunkCount; ChunkIndex++)
+        {
+            AddWorkEntry(SpeculateChunk, Chunks + ChunkIndex);
+        }
+        CompleteAllWork();
+        
+        // A chunk is only used if it starts exactly where the chunk in front of it stopped. The first chunk
+        // starts at a real block, so every linked chunk does. Otherwise the chunk in front keeps decoding,
+        // straight into the stream once the chunks in front of it are resolved.
+        png_speculative_chunk *Pending[PNG_MAX_SPECULATIVE_CHUNKS];
+        u32 PendingCount = 0;
+        for(u32 ChunkIndex = 1; ChunkIndex < ChunkCount && !Active->Error && !Active->LastBlock; ChunkIndex++)
+        {
+            png_speculative_chunk *Next = Chunks + ChunkIndex;
+            if(!Next->Found || Next->Error)
+            {
+                continue;
+            }
+            if(Active->EndBit < Next->StartBit)
+            {
+                if(!Active->Output)
+                {
+                    Result = StorePendingChunks(&Output, Pending, PendingCount);
+                    PendingCount = 0;
+                    if(!Result)
                     {
-                        u16 LengthCode = Code.Value - 257;
-                        u8 ExtraBits = DEFLATE_LENGTH_BITS[LengthCode];
-                        BufferBits(&BitReader, ExtraBits);
-                        u32 BytesToCopy = ConsumeBits(&BitReader, ExtraBits) + DEFLATE_LENGTH_ADD[LengthCode];
-                        
-                        BufferBits(&BitReader, 15);
-                        deflate_code DistanceCode = DistanceDictionary[PeekBits(&BitReader, 15)];
-                        DropBits(&BitReader, DistanceCode.Length);
-                        ExtraBits = DEFLATE_DISTANCE_BITS[DistanceCode.Value];
-                        BufferBits(&BitReader, ExtraBits);
-                        u32 Distance = ConsumeBits(&BitReader, ExtraBits) + DEFLATE_DISTANCE_ADD[DistanceCode.Value];
-                        u8* From = To - Distance;
-                        
-                        u8 *CopyEnd = To + BytesToCopy;
-                        if(CopyEnd > BufferEnd)
-                        {
-                            LogError("The decoded data stream overflows the image buffer.", "PNG Reader");
-                            return;
-                        }
-                        while(BytesToCopy--)
-                        {
-                            *(To++) = *(From++);
-                        }
+                        break;
                     }
+                    MakeChunkDirect(Active, &Output);
                 }
-            } break;//End of compression type 1 and 2
+                Active->StopBit = Next->StartBit;
+                InflateChunk(Active);
+            }
+            if(!Active->Error && !Active->LastBlock && Active->EndBit == Next->StartBit)
+            {
+                Pending[PendingCount++] = Next;
+                Active = Next;
+            }
+        }
+        if(Result && PendingCount)
+        {
+            Result = StorePendingChunks(&Output, Pending, PendingCount);
+        }
+        if(Result && !Active->Output)
+        {
+            MakeChunkDirect(Active, &Output);
+        }
+        if(Result && LastWave && !Active->Error && !Active->LastBlock)
+        {
+            Active->StopBit = U64Max;
+            InflateChunk(Active);
+        }
+        Result = (Result && !Active->Error && (Active->LastBlock || !LastWave));
+        Done   = Active->LastBlock;
+        
+        DataStart += Active->EndBit / 8;
+        FirstBit   = Active->EndBit % 8;
+    }
+    
+    if(Result)
+    {
+        Result = FlushWindow(&Output.Window, Scanlines, &Output.To, 0);
+    }
+    if(!Result)
+    {
+        // The serial decode starts over, with the image and the row buffers as they were.
+        *Scanlines = Restart;
+        u64 ImageSize = Restart.BytesPerRow * Restart.Height;
+        for(u64 I = 0; I < ImageSize; I++)
+        {
+            Restart.Image[I] = 0;
+        }
+        for(u64 I = 0; I < 2 * Restart.BytesPerRow; I++)
+        {
+            Restart.LastRow[I] = 0;
+        }
+    }
+    
+    FreeImageBuffer(Buffer);
+    return(Result);
+}
+
+#if PNG_ANIMATION_PLAYBACK
+// Blends a converted row of a frame into the canvas. Both hold 8 bit RGBA without premultiplied alpha.
+static void
+BlendFrameRow(u8 *To, u8 *From, u32 Width, u8 BlendOp)
+{
+    u8 *FromEnd = From + (u64)Width * 4;
+    if(BlendOp != APNG_BLEND_OP_OVER)
+    {
+        while(From < FromEnd)
+        {
+            *(To++) = *(From++);
+        }
+        return;
+    }
+    
+    for(; From < FromEnd; From += 4, To += 4)
+    {
+        u32 SourceAlpha = From[3];
+        if(SourceAlpha == U8Max)
+        {
+            *(u32 *)To = *(u32 *)From;
+        }
+        else if(SourceAlpha)
+        {
+            u32 SourceWeight = SourceAlpha * U8Max;
+            u32 TargetWeight = (U8Max - SourceAlpha) * To[3];
+            u32 Alpha = SourceWeight + TargetWeight;
+            for(u32 Channel = 0; Channel < 3; Channel++)
+            {
+                To[Channel] = (u8)((From[Channel] * SourceWeight + To[Channel] * TargetWeight + Alpha / 2) / Alpha);
+            }
+            To[3] = (u8)((Alpha + U8Max / 2) / U8Max);
         }
     }
 }
 
+// Copies a rectangle of 8 bit RGBA pixels, Pitch is the distance between rows in bytes. Without From, the
+// rectangle gets cleared.
 static void
-UndoFilter(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel)
+CopyCanvasRegion(u8 *To, u64 ToPitch, u8 *From, u64 FromPitch, u32 Width, u32 Height)
 {
-    switch(*(At++))
+    for(u32 Y = 0; Y < Height; Y++)
     {
-        case 0://none
+        u32 *Target = (u32 *)(To + Y * ToPitch);
+        u32 *Source = (u32 *)(From + Y * FromPitch);
+        for(u32 X = 0; X < Width; X++)
         {
-            while(At < RowEnd)
-            {
-                *(To++) = *(At++);
-            }
-        } break;
-        
-        case 1://sub
+            Target[X] = (From) ? Source[X] : 0;
+        }
+    }
+}
+
+// Every frame gets inflated into the same scratch, converted into 8 bit RGBA row by row and composed into
+// a single canvas, which is handed to the platform after each frame, until the platform wants no more of
+// them. The memory doesn't grow with the number of frames. Returns false if no frame could be shown, so the
+// default image gets decoded instead.
+static b32
+DecodeAnimatedPNG(image_processor_tasks Processor, b32 Interlaced, png_chunk *AnimationChunk,
+                  png_chunk *FrameChunk, png_chunk *Chunk, void *FileEndpoint,
+                  u8 *TransparencyMemory, u32 TransparencyLength, b32 CRCsMatch, image_probe *Probe)
+{
+    png_animation_control *Animation = (png_animation_control *)AnimationChunk->Data;
+    u32 FrameCount = SwapEndian(Animation->FrameCount);
+    if(FrameCount == 0)
+    {
+        return(false);
+    }
+    
+    // The IDAT and fdAT chunks of the whole file are an upper bound for the chunks of a single frame.
+    u32 MaxSpanCount = 0;
+    for(png_chunk *At = Chunk; At + 1 <= FileEndpoint && At->TypeU32 != PNG_IEND;
+        At = (png_chunk *)(At->OffsetBase + SwapEndian(At->Length)))
+    {
+        if(At->TypeU32 == PNG_IDAT || At->TypeU32 == PNG_fdAT)
         {
-            u8 *Left = To;
-            u8 *SecondPixel = At + BytesPerPixel;
-            while(At < SecondPixel)
-            {
-                *(To++) = *(At++);
-            }
-            while(At < RowEnd)
+            MaxSpanCount++;
+        }
+    }
+    
+    u32 Width  = Processor.Width;
+    u32 Height = Processor.Height;
+    u64 BytesPerRow       = ((u64)Processor.BitsPerPixel * (u64)Width + 7) / 8;
+    u64 FrameBufferSize   = (u64)Height * BytesPerRow;
+    u64 RowBufferSize     = 2 * BytesPerRow;
+    u64 DeflateBufferSize = InflateWindowSize(Width, Height, Processor.BitsPerPixel, Interlaced);
+    u64 PalletBufferSize  = 0;
+    if(TransparencyLength != 0)
+    {
+        PalletBufferSize = Processor.PalletSize * 4;
+    }
+    u64 CanvasSize = (u64)Width * (u64)Height * 4;
+    
+    u64 DecoderOffset  = AlignPow2(FrameBufferSize, 8);
+    u64 PalletOffset   = DecoderOffset + AlignPow2(sizeof(png_decoding_buffers) - 1 + DeflateBufferSize +
+                                                   DEFLATE_COPY_PADDING + RowBufferSize, 8);
+    u64 ConversionPalletOffset = PalletOffset + AlignPow2(PalletBufferSize, 8);
+    u64 SpanOffset     = ConversionPalletOffset + (u64)GetConversionPalletSize(Processor.PalletSize) * 4;
+    u64 RowOffset      = AlignPow2(SpanOffset + MaxSpanCount * sizeof(png_data_span), 16);
+    u64 CanvasOffset   = AlignPow2(RowOffset + (u64)Width * 4, 16);
+    u64 PreviousOffset = CanvasOffset + CanvasSize;
+    
+    image_processor_tasks CanvasProcessor = {};
+    CanvasProcessor.Width         = Width;
+    CanvasProcessor.Height        = Height;
+    CanvasProcessor.BitsPerPixel  = 32;
+    CanvasProcessor.ByteAlignment = 1;
+    CanvasProcessor.RedMask       = 0x000000ff;
+    CanvasProcessor.GreenMask     = 0x0000ff00;
+    CanvasProcessor.BlueMask      = 0x00ff0000;
+    CanvasProcessor.AlphaMask     = 0xff000000;
+    u64 CanvasPitch = (u64)Width * 4;
+    
+    if(Probe)
+    {
+        SetImageProbe(Probe, CanvasProcessor, Interlaced, FrameCount, PreviousOffset + CanvasSize, CanvasSize);
+        return(true);
+    }
+    
+    u8 *Buffer = (u8 *)RequestImageBuffer(PreviousOffset + CanvasSize);
+    
+    png_decoding_buffers *Buffers = (png_decoding_buffers *)(Buffer + DecoderOffset);
+    u8 *RowBuffers = Buffers->DeflateBuffer + DeflateBufferSize + DEFLATE_COPY_PADDING;
+    if(PalletBufferSize)
+    {
+        u8* PalletBuffer = Buffer + PalletOffset;
+        AddAlphaToPallet(PalletBuffer, Processor.PalletData, Processor.PalletSize,
+                         TransparencyMemory, TransparencyLength);
+        Processor.PalletData         = PalletBuffer;
+        Processor.BitsPerPalletColor = 32;
+        Processor.AlphaMask          = 0xff000000;
+    }
+    u32 *ConversionPallet = (u32 *)(Buffer + ConversionPalletOffset);
+    png_data_span *Spans  = (png_data_span *)(Buffer + SpanOffset);
+    u8 *FrameImage = Buffer;
+    u8 *Row        = Buffer + RowOffset;
+    u8 *Canvas     = Buffer + CanvasOffset;
+    u8 *Previous   = Buffer + PreviousOffset;
+    
+    char *Error = 0;
+    b32 AdlersMatch = true;
+    u32 FrameIndex = 0;
+    u32 DataType = PNG_IDAT;
+    png_chunk *DataChunk = Chunk;
+    // The default image is only the first frame, if a frame control chunk comes in front of it.
+    while(FrameIndex < FrameCount)
+    {
+        if(FrameChunk)
+        {
+            png_frame_control *Frame = (png_frame_control *)FrameChunk->Data;
+            u32 FrameWidth  = SwapEndian(Frame->Width);
+            u32 FrameHeight = SwapEndian(Frame->Height);
+            u32 OffsetX     = SwapEndian(Frame->OffsetX);
+            u32 OffsetY     = SwapEndian(Frame->OffsetY);
+            if(SwapEndian(FrameChunk->Length) < sizeof(png_frame_control) ||
+               FrameWidth == 0 || OffsetX > Width || FrameWidth > Width - OffsetX ||
+               FrameHeight == 0 || OffsetY > Height || FrameHeight > Height - OffsetY ||
+               (DataType == PNG_IDAT && (FrameWidth != Width || FrameHeight != Height)))
             {
-                *(To++) = *(At++) + *(Left++);
+                Error = "A frame of the animation doesn't fit into the image.";
+                break;
             }
-        } break;
-        
-        case 2://up
-        {
-            u8 *Up = LastRow;
-            while(At < RowEnd)
+            if(VerifyChecksums && !ChunkCRCMatches(FrameChunk, FileEndpoint))
             {
-                *(To++) = *(At++) + *(Up++);
+                CRCsMatch = false;
             }
-        } break;
-        
-        case 3://average
-        {
-            u8 *Up = LastRow;
-            u8 *Left = To;
-            u8 *SecondPixel = At + BytesPerPixel;
-            while(At < SecondPixel)
+            
+            u8 *Region = Canvas + OffsetY * CanvasPitch + (u64)OffsetX * 4;
+            u64 RegionPitch = (u64)FrameWidth * 4;
+            u8 DisposeOp = Frame->DisposeOp;
+            if(DisposeOp == APNG_DISPOSE_OP_PREVIOUS)
             {
-                *(To++) = *(At++) + (*(Up++) / 2);
+                // Before the first frame this saves the cleared canvas, as the specification asks for.
+                CopyCanvasRegion(Previous, RegionPitch, Region, CanvasPitch, FrameWidth, FrameHeight);
             }
-            while(At < RowEnd)
+            
+            // Interlaced scanlines get or'ed into the image, and rows the stream doesn't reach should be empty.
+            u64 FrameBytesPerRow = ((u64)Processor.BitsPerPixel * (u64)FrameWidth + 7) / 8;
+            u64 FrameSize = FrameHeight * FrameBytesPerRow;
+            for(u64 I = 0; I < FrameSize; I++)
             {
-                *(To++) = *(At++) + (u8)(((u16)*(Left++) + (u16)*(Up++)) / 2);
+                FrameImage[I] = 0;
             }
-        } break;
-        
-        case 4://peath
-        {
-            u8 *a = To;
-            u8 *b = LastRow;
-            u8 *c = LastRow;
-            u8 *SecondPixel = At + BytesPerPixel;
-            while(At < SecondPixel)
+            
+            png_segment_work Segment = {};
+            Segment.Spans      = Spans;
+            Segment.SpanCount  = IndexDataSpans(DataChunk, FileEndpoint, Spans, DataType, 0);
+            Segment.ZlibHeader = true;
+            Segment.Buffers    = Buffers;
+            Segment.WindowSize = DeflateBufferSize;
+            InitializeScanlines(&Segment.Scanlines, FrameImage, RowBuffers,
+                                FrameWidth, FrameHeight, Processor.BitsPerPixel, Interlaced);
+            DecodePNGSegment(&Segment);
+            if(Segment.Error && !Error)
             {
-                *(To++) = *(At++) + *(b++);
+                Error = Segment.Error;
             }
-            while(At < RowEnd)
+            if(VerifyChecksums)
             {
-                s32 pa = (s32)*b - (s32)*c;
-                s32 pb = (s32)*a - (s32)*c;
-                s32 pc = Absolute(pa + pb);
-                pa     = Absolute(pa);
-                pb     = Absolute(pb);
-                
-                u8 Pr = *a;
-                if(pb < pa)
+                if(!SpanCRCsMatch(Spans, Segment.SpanCount, FileEndpoint))
                 {
-                    pa = pb;
-                    Pr = *b;
+                    CRCsMatch = false;
                 }
-                if(pc < pa)
+                if(!Segment.Error && Segment.Scanlines.Adler != StoredAdler32(Spans, Segment.SpanCount))
                 {
-                    Pr = *c;
+                    AdlersMatch = false;
                 }
-                
-                *(To++) = *(At++) + Pr;
-                a++;
-                b++;
-                c++;
             }
-        } break;
-    }
-}
-
-static void
-UndoFilters(u8 *Source, u8 *Target, u8 *RowBuffers,
-            u32 Width, u32 Height, u32 BitsPerPixel)
-{
-    u32 BytesPerPixel = (BitsPerPixel + 7) / 8;
-    u64 BytesPerRow = ((u64)BitsPerPixel * (u64)Width + 7) / 8;
-    
-    if(RowBuffers)
-    {
-        u8 *At = Source;
-        u8 *Row = RowBuffers;
-        u8 *LastRow = Row + BytesPerRow;
-        
-        if(BitsPerPixel < 8)
-        {
-            u32 PixelMask = 0x100 - (1 << (8 - BitsPerPixel));
-            for(u8 Cycle = 0; Cycle < 7; Cycle++)
+            
+            image_processor_tasks FrameProcessor = Processor;
+            FrameProcessor.Width  = FrameWidth;
+            FrameProcessor.Height = FrameHeight;
+            image_conversion Conversion;
+            PrepareConversion(&Conversion, FrameProcessor, ConversionPallet, false);
+            for(u32 Y = 0; Y < FrameHeight; Y++)
             {
-                u32 oX = INTERLACE_X_OFFSET[Cycle];
-                u32 iX = INTERLACE_X_INCREMENT[Cycle];
-                u32 oY = INTERLACE_Y_OFFSET[Cycle];
-                u32 iY = INTERLACE_Y_INCREMENT[Cycle];
-                
-                if(oX >= Width)
-                    continue;
-                
-                u64 ScanlineIncrement = 1 + ((Width + iX - 1 - oX) / iX * BitsPerPixel + 7) / 8;
-                
-                for(u32 I = 0; I < BytesPerRow; I++)
-                {
-                    LastRow[I] = 0;
-                }
-                
-                for(u32 Y = oY; Y < Height; Y += iY)
-                {
-                    u8 *ScanlineEnd = At + ScanlineIncrement;
-                    UndoFilter(At, Row, ScanlineEnd, LastRow, BytesPerPixel);
-                    
-                    u8* From        = Row;
-                    u64 ImageBit    = Y * BytesPerRow * 8 + oX * BitsPerPixel;
-                    u8  CurrentByte = 0;
-                    u32 BitsShifted = 8;
-                    for(u32 X = oX; X < Width; X += iX)
-                    {
-                        if(BitsShifted >= 8)
-                        {
-                            CurrentByte = *(From++);
-                            BitsShifted = 0;
-                        }
-                        
-                        Target[ImageBit/8] |= (CurrentByte & PixelMask) >> (ImageBit & 7);
-                        CurrentByte       <<= BitsPerPixel;
-                        BitsShifted        += BitsPerPixel;
-                        ImageBit           += iX * BitsPerPixel;
-                    }
-                    
-                    At = ScanlineEnd;
-                    u8* Temp = LastRow;
-                    LastRow = Row;
-                    Row = Temp;
-                }
+                ConvertRows(&Conversion, FrameImage + Y * FrameBytesPerRow, Row, 0, 1);
+                BlendFrameRow(Region + Y * CanvasPitch, Row, FrameWidth, Frame->BlendOp);
+            }
+            
+            u32 DelayDenominator = SwapEndian(Frame->DelayDenominator);
+            if(DelayDenominator == 0)
+            {
+                DelayDenominator = 100;
+            }
+            u32 Delay = SwapEndian(Frame->DelayNumerator) * 1000 / DelayDenominator;
+            b32 NextFrameWanted = StoreAnimationFrame(Canvas, CanvasProcessor, FrameIndex, Delay);
+            FrameIndex++;
+            if(!NextFrameWanted)
+            {
+                break;
+            }
+            
+            if(DisposeOp == APNG_DISPOSE_OP_BACKGROUND)
+            {
+                CopyCanvasRegion(Region, CanvasPitch, 0, 0, FrameWidth, FrameHeight);
+            }
+            else if(DisposeOp == APNG_DISPOSE_OP_PREVIOUS)
+            {
+                CopyCanvasRegion(Region, CanvasPitch, Previous, RegionPitch, FrameWidth, FrameHeight);
             }
         }
-        else
+        
+        // The fdAT chunks of the next frame follow its frame control chunk.
+        FrameChunk = 0;
+        while(!FrameChunk && DataChunk + 1 <= FileEndpoint && DataChunk->TypeU32 != PNG_IEND)
         {
-            for(u8 Cycle = 0; Cycle < 7; Cycle++)
+            u8 *NextChunk = DataChunk->OffsetBase + SwapEndian(DataChunk->Length);
+            if(NextChunk > FileEndpoint)
             {
-                u32 oX = INTERLACE_X_OFFSET[Cycle];
-                u32 iX = INTERLACE_X_INCREMENT[Cycle];
-                u32 oY = INTERLACE_Y_OFFSET[Cycle];
-                u32 iY = INTERLACE_Y_INCREMENT[Cycle];
-                
-                u64 ScanlineIncrement = 1 + (Width + iX - 1 - oX) / iX * BitsPerPixel / 8;
-                
-                for(u32 I = 0; I < BytesPerRow; I++)
-                {
-                    LastRow[I] = 0;
-                }
-                
-                for(u32 Y = oY; Y < Height; Y += iY)
-                {
-                    u8 *ScanlineEnd = At + ScanlineIncrement;
-                    UndoFilter(At, Row, ScanlineEnd, LastRow, BytesPerPixel);
-                    
-                    u8* From = Row;
-                    for(u32 X = oX; X < Width; X += iX)
-                    {
-                        for(u32 P = 0; P < BytesPerPixel; P++)
-                        {
-                            Target[P + X * BytesPerPixel + Y * BytesPerRow] = *(From++);
-                        }
-                    }
-                    
-                    At = ScanlineEnd;
-                    u8* Temp = LastRow;
-                    LastRow = Row;
-                    Row = Temp;
-                }
+                break;
+            }
+            if(DataChunk->TypeU32 == PNG_fcTL)
+            {
+                FrameChunk = DataChunk;
             }
+            DataChunk = (png_chunk *)NextChunk;
+        }
+        if(!FrameChunk)
+        {
+            break;
         }
+        DataType = PNG_fdAT;
     }
-    else
+    
+    if(Error)
     {
-        u8 *At = Source;
-        u8 *Row = Target;
-        u8 *LastRow = Row + BytesPerRow;
-        
-        u64 ScanlineIncrement = 1 + BytesPerRow;
-        u32 LinesLeft = Height;
-        while(LinesLeft--)
+        LogError(Error, "PNG Reader");
+    }
+    if(!CRCsMatch)
+    {
+        LogError("The CRC of a chunk doesn't match its contents.", "PNG Reader");
+    }
+    if(!AdlersMatch)
+    {
+        LogError("The Adler-32 checksum doesn't match the decoded image data.", "PNG Reader");
+    }
+    
+    FreeImageBuffer(Buffer);
+    return(FrameIndex > 0);
+}
+#endif
+
+// Moves the columns of the region to the front of the buffer, so its rows follow each other without gaps.
+static void
+CompactRegionRows(u8 *Image, u64 BytesPerRow, u32 FirstRow, u64 FirstByte, u64 RegionBytesPerRow, u32 RowCount)
+{
+    u8 *Destination = Image;
+    for(u32 Y = FirstRow; Y < FirstRow + RowCount; Y++)
+    {
+        // Forward copy, the destination never lies behind the source.
+        u8 *From = Image + Y * BytesPerRow + FirstByte;
+        u8 *End  = From + RegionBytesPerRow;
+        while(End - From >= 16)
+        {
+            _mm_storeu_si128((__m128i *)Destination, _mm_loadu_si128((__m128i *)From));
+            From += 16;
+            Destination += 16;
+        }
+        while(From < End)
         {
-            u8 *ScanlineEnd = At + ScanlineIncrement;
-            UndoFilter(At, Row, ScanlineEnd, LastRow, BytesPerPixel);
-            At = ScanlineEnd;
-            LastRow = Row;
-            Row += BytesPerRow;
+            *(Destination++) = *(From++);
         }
     }
 }
 
+// With a region, only that part of the image gets stored. The stream is inflated down to the last row of
+// the region, the rows above it are unfiltered without being kept. With a probe, the reader stops right
+// before requesting its buffer and only fills in the probe.
 b32
-PNG_Reader(void *FileMemory, void *FileEndpoint)
+PNG_Reader(void *FileMemory, void *FileEndpoint, image_region *Region, image_probe *Probe)
 {
     png_file_header *Header = (png_file_header *)FileMemory;
     if(Header + 1 > FileEndpoint || Header->Signature != PNG_SIGNATURE || Header->TypeU32 != PNG_IHDR)
     {
         return(false);
     }
+    // Built before any work gets queued, the worker threads only read them.
+    InitializeFixedDictionaries();
+    InitializeInterlaceSpread();
     
     u8 ColorType = Header->ColorType;
     u8 BitDepth = Header->BitDepth;
@@ -654,14 +3510,25 @@ PNG_Reader(void *FileMemory, void *FileEndpoint)
     
     u8 *TransparencyMemory = 0;
     u32 TransparencyLenght = 0;
+    png_chunk *DivisionChunk = 0;
+    u32 DivisionLength = 0;
+#if PNG_ANIMATION_PLAYBACK
+    png_chunk *AnimationChunk = 0;
+    png_chunk *FrameChunk = 0;
+#endif
     
     png_chunk *Chunk = &Header->Chunk;
+    b32 CRCsMatch = (!VerifyChecksums || ChunkCRCMatches(Chunk, FileEndpoint));
     u32 Length = SwapEndian(Chunk->Length);
     u8 *NextChunk = Chunk->OffsetBase + Length;
     Chunk = (png_chunk *)(NextChunk);
     
     while(Chunk + 1 <= FileEndpoint && Chunk->TypeU32 != PNG_IDAT)
     {
+        if(VerifyChecksums && !ChunkCRCMatches(Chunk, FileEndpoint))
+        {
+            CRCsMatch = false;
+        }
         Length = SwapEndian(Chunk->Length);
         NextChunk = Chunk->OffsetBase + Length;
         if(NextChunk <= FileEndpoint)
@@ -705,19 +3572,40 @@ PNG_Reader(void *FileMemory, void *FileEndpoint)
                         if(Processor.BitsPerPixel == 48)
                         {
                             Processor.TransparentColor = 
-                                ((u64)*(((u16 *)Chunk->Data) + 0) << 32) |
+                                ((u64)*(((u16 *)Chunk->Data) + 0)      ) |
                                 ((u64)*(((u16 *)Chunk->Data) + 1) << 16) |
-                                ((u64)*(((u16 *)Chunk->Data) + 2)      );
+                                ((u64)*(((u16 *)Chunk->Data) + 2) << 32);
                         }
                         else
                         {
+                            // The samples are 16 bit big endian, so the 8 bit values sit in their second bytes.
                             Processor.TransparentColor = 
-                                (*(((u16 *)Chunk->Data) + 0) << 8) |
+                                (*(((u16 *)Chunk->Data) + 0) >> 8) |
                                 (*(((u16 *)Chunk->Data) + 1)     ) |
-                                (*(((u16 *)Chunk->Data) + 2) >> 8);
+                                (*(((u16 *)Chunk->Data) + 2) << 8);
                         }
                     }
                 } break;
+                case PNG_iDOT:
+                {
+                    DivisionChunk  = Chunk;
+                    DivisionLength = Length;
+                } break;
+                
+#if PNG_ANIMATION_PLAYBACK
+                case PNG_acTL:
+                {
+                    if(Length >= sizeof(png_animation_control))
+                    {
+                        AnimationChunk = Chunk;
+                    }
+                } break;
+                
+                case PNG_fcTL:
+                {
+                    FrameChunk = Chunk;
+                } break;
+#endif
 #if 0
                 // Colour space information
                 case PNG_cHRM:
@@ -728,10 +3616,6 @@ PNG_Reader(void *FileMemory, void *FileEndpoint)
                 case PNG_cICP:
                 case PNG_mDCv:
                 case PNG_cLLi:
-                // Animation information
-                case PNG_acTL:
-                case PNG_fcTL:
-                case PNG_fdAT:
                 // Textual information
                 case PNG_iTXt:
                 case PNG_tEXt:
@@ -749,55 +3633,309 @@ PNG_Reader(void *FileMemory, void *FileEndpoint)
         Chunk = (png_chunk *)(NextChunk);
     }
     
-    u64 BytesPerRow       = ((u64)Processor.BitsPerPixel * (u64)Processor.Width + 7) / 8;
-    u64 ImageBufferSize   = (u64)Processor.Height * BytesPerRow;
-    u64 ScanlinePadding   = Processor.Height;
-    u64 RowBufferSize     = 0;
-    if(Header->Interlace == 1)
+    b32 Interlaced = (Header->Interlace == 1);
+    u32 RegionX      = 0;
+    u32 RegionY      = 0;
+    u32 RegionWidth  = Processor.Width;
+    u32 RegionHeight = Processor.Height;
+    if(Region)
     {
-        ScanlinePadding += Processor.Height - (Processor.Height / 8);
-        RowBufferSize = 2 * BytesPerRow;
-        if(Processor.BitsPerPixel < 8)
+        if(Region->X >= Processor.Width || Region->Y >= Processor.Height || !Region->Width || !Region->Height)
+        {
+            LogError("The requested region lies outside of the image.", "PNG Reader");
+            return(true);
+        }
+        RegionX      = Region->X;
+        RegionY      = Region->Y;
+        RegionWidth  = Processor.Width  - RegionX;
+        RegionHeight = Processor.Height - RegionY;
+        if(Region->Width < RegionWidth)
         {
-            ScanlinePadding *= 2;
+            RegionWidth = Region->Width;
         }
+        if(Region->Height < RegionHeight)
+        {
+            RegionHeight = Region->Height;
+        }
+    }
+    // Interlaced rows get filled in by every pass, so those images are kept whole until the region gets cut out.
+    u32 FirstStoredRow = (Interlaced) ? 0 : RegionY;
+    u32 StoredRowCount = (Interlaced) ? Processor.Height : RegionHeight;
+    
+#if PNG_ANIMATION_PLAYBACK
+    if(AnimationChunk && !Region &&
+       DecodeAnimatedPNG(Processor, Interlaced, AnimationChunk, FrameChunk, Chunk, FileEndpoint,
+                         TransparencyMemory, TransparencyLenght, CRCsMatch, Probe))
+    {
+        return(true);
     }
+#endif
+    
+    u64 BytesPerRow       = ((u64)Processor.BitsPerPixel * (u64)Processor.Width + 7) / 8;
+    u64 ImageBufferSize   = (u64)StoredRowCount * BytesPerRow;
+    u64 RowBufferSize     = 2 * BytesPerRow;
+    
+    u64 DeflateBufferSize = InflateWindowSize(Processor.Width, Processor.Height, Processor.BitsPerPixel,
+                                              Interlaced);
     u64 PalletBufferSize  = 0;
     if(TransparencyLenght != 0)
     {
         PalletBufferSize = Processor.PalletSize * 4;
     }
     
-    u64 DeflateBufferSize  = ImageBufferSize + ScanlinePadding;
-    u64 CombinedBufferSize = ImageBufferSize + 
-        sizeof(png_decoding_buffers) - 1 + DeflateBufferSize +
-        RowBufferSize + PalletBufferSize;
+    // Every segment gets its own tables, window and row buffers.
+    u32 SegmentCount = 1;
+    if(DivisionChunk && !Interlaced && DivisionLength >= 4 && !Region)
+    {
+        u32 HintCount = SwapEndian(*(u32 *)DivisionChunk->Data);
+        if(HintCount > 1 && HintCount <= PNG_MAX_SEGMENTS &&
+           DivisionLength == 4 + HintCount * sizeof(png_idot_segment))
+        {
+            SegmentCount = HintCount;
+        }
+    }
+    
+    u64 CompressedSize = 0;
+    u32 SpanCount = IndexDataSpans(Chunk, FileEndpoint, 0, PNG_IDAT, &CompressedSize);
+    u64 SpanBufferSize = SpanCount * sizeof(png_data_span);
+    
+    // Formats that can't be displayed as they are get converted into RGBA right after unfiltering. 16 bit
+    // images keep their precision as 16 bit RGBA, the others become 8 bit RGBA. Gray images with whole
+    // bytes per channel stay a single gray channel, with or without alpha, the platform spreads it over RGB.
+    // 8 bit indices stay indices, the platform looks them up in the pallet.
+    b32 Displayable = (ColorType == PNG_COLOR_TYPE_RGB || ColorType == PNG_COLOR_TYPE_RGB_ALPHA ||
+                       ((ColorType == PNG_COLOR_TYPE_GRAY || ColorType == PNG_COLOR_TYPE_GRAY_ALPHA ||
+                         ColorType == PNG_COLOR_TYPE_PALETTE) && BitDepth >= 8));
+    b32 Convert = (!Displayable || Processor.TransparentColor);
+    b32 ConvertWide = (BitDepth == 16);
+    u32 ConvertedBytesPerPixel = (ConvertWide) ? 8 : 4;
+    u64 ConvertedBufferSize = 0;
+    if(Convert)
+    {
+        ConvertedBufferSize = (u64)RegionWidth * (u64)RegionHeight * ConvertedBytesPerPixel +
+            (u64)GetConversionPalletSize(Processor.PalletSize) * 4;
+    }
+    
+    u64 DecoderSize = AlignPow2(sizeof(png_decoding_buffers) - 1 + DeflateBufferSize + DEFLATE_COPY_PADDING +
+                                RowBufferSize, 8);
+    u64 DecoderOffset   = AlignPow2(ImageBufferSize, 8);
+    u64 PalletOffset    = DecoderOffset + SegmentCount * DecoderSize;
+    u64 SpanOffset      = PalletOffset + AlignPow2(PalletBufferSize, 8);
+    u64 ConvertedOffset = AlignPow2(SpanOffset + SpanBufferSize, 16);
+    u64 CombinedBufferSize = ConvertedOffset + ConvertedBufferSize;
     
+    if(PalletBufferSize)
+    {
+        // The pallet gets its transparency added in its own buffer, below.
+        Processor.BitsPerPalletColor = 32;
+        Processor.AlphaMask          = 0xff000000;
+    }
+    image_processor_tasks StoredProcessor = Processor;
+    StoredProcessor.Width  = RegionWidth;
+    StoredProcessor.Height = RegionHeight;
+    if(Convert)
+    {
+        StoredProcessor.BigEndian        = false;
+        StoredProcessor.PalletData       = 0;
+        StoredProcessor.PalletSize       = 0;
+        StoredProcessor.TransparentColor = 0;
+        if(ConvertWide)
+        {
+            StoredProcessor.BitsPerPixel = 64;
+            StoredProcessor.RedMask      = 0x000000000000ffff;
+            StoredProcessor.GreenMask    = 0x00000000ffff0000;
+            StoredProcessor.BlueMask     = 0x0000ffff00000000;
+            StoredProcessor.AlphaMask    = 0xffff000000000000;
+        }
+        else
+        {
+            StoredProcessor.BitsPerPixel = 32;
+            StoredProcessor.RedMask      = 0x000000ff;
+            StoredProcessor.GreenMask    = 0x0000ff00;
+            StoredProcessor.BlueMask     = 0x00ff0000;
+            StoredProcessor.AlphaMask    = 0xff000000;
+        }
+    }
     
+    b32 Previewed = (ProgressivePreview && Interlaced && !Region &&
+                     (u64)Processor.Width * (u64)Processor.Height >= PNG_PREVIEW_MIN_PIXELS);
+    if(Probe)
+    {
+        u64 StoredSize = (u64)RegionWidth * (u64)RegionHeight * ConvertedBytesPerPixel;
+        if(!Convert)
+        {
+            StoredSize = ((u64)Processor.BitsPerPixel * (u64)RegionWidth + 7) / 8 * (u64)RegionHeight;
+        }
+        
+        // Decoding the whole stream in one go can request the buffer of the speculative inflate on top, and the
+        // window of the pipelined one if that fails, each freed before the next. Streams of stored blocks need
+        // neither, but telling them apart means walking the stream, so they count like any other.
+        u64 ScratchSize = 0;
+        if(!Region && !Previewed)
+        {
+            ScratchSize = PipelinedBufferSize(Processor.Width, Processor.Height, Processor.BitsPerPixel, Interlaced);
+            png_speculative_plan Plan;
+            if(PlanSpeculativeInflate(&Plan, Processor.Width, Processor.Height, Processor.BitsPerPixel, Interlaced,
+                                      CompressedSize, SpanCount) && Plan.BufferSize > ScratchSize)
+            {
+                ScratchSize = Plan.BufferSize;
+            }
+        }
+        SetImageProbe(Probe, StoredProcessor, Interlaced, 1, CombinedBufferSize + ScratchSize, StoredSize);
+        return(true);
+    }
     
     void *Buffer = RequestImageBuffer(CombinedBufferSize);
     
-    png_decoding_buffers *DeflateBuffers = (png_decoding_buffers *)((u8 *)Buffer + ImageBufferSize);
-    u8* RowBuffers = 0;
-    if(RowBufferSize)
+    png_segment_work Segments[PNG_MAX_SEGMENTS] = {};
+    for(u32 SegmentIndex = 0; SegmentIndex < SegmentCount; SegmentIndex++)
     {
-        RowBuffers = DeflateBuffers->DeflateBuffer + DeflateBufferSize;
+        Segments[SegmentIndex].Buffers    = (png_decoding_buffers *)((u8 *)Buffer + DecoderOffset +
+                                                                     SegmentIndex * DecoderSize);
+        Segments[SegmentIndex].WindowSize = DeflateBufferSize;
+        Segments[SegmentIndex].ZlibHeader = (SegmentIndex == 0);
     }
     if(PalletBufferSize)
     {
-        u8* PalletBuffer = DeflateBuffers->DeflateBuffer + DeflateBufferSize + RowBufferSize;
+        u8* PalletBuffer = (u8 *)Buffer + PalletOffset;
         AddAlphaToPallet(PalletBuffer, Processor.PalletData, Processor.PalletSize,
                          TransparencyMemory, TransparencyLenght);
-        Processor.PalletData         = PalletBuffer;
-        Processor.BitsPerPalletColor = 32;
-        Processor.AlphaMask          = 0xff000000;
+        Processor.PalletData = PalletBuffer;
+        if(!Convert)
+        {
+            StoredProcessor.PalletData = PalletBuffer;
+        }
+    }
+    png_data_span *Spans = (png_data_span *)((u8 *)Buffer + SpanOffset);
+    IndexDataSpans(Chunk, FileEndpoint, Spans, PNG_IDAT, 0);
+    
+    u8 *ConvertedBuffer = (u8 *)Buffer + ConvertedOffset;
+    image_conversion Conversion = {};
+    if(Convert)
+    {
+        PrepareConversion(&Conversion, Processor, (u32 *)(ConvertedBuffer + (u64)RegionWidth *
+                                                          (u64)RegionHeight * ConvertedBytesPerPixel),
+                          ConvertWide);
+        Conversion.FirstColumn = RegionX;
+        Conversion.ColumnCount = RegionWidth;
+    }
+    
+    b32 Pipelined = false;
+    b32 Divided = (SegmentCount > 1 &&
+                   DivideSpans(DivisionChunk, Processor.Height, Spans, SpanCount, Segments, SegmentCount));
+    if(Divided)
+    {
+        for(u32 SegmentIndex = 0; SegmentIndex < SegmentCount; SegmentIndex++)
+        {
+            png_segment_work *Segment = Segments + SegmentIndex;
+            u8 *RowBuffers = Segment->Buffers->DeflateBuffer + DeflateBufferSize + DEFLATE_COPY_PADDING;
+            InitializeScanlines(&Segment->Scanlines, (u8 *)Buffer + Segment->FirstRow * BytesPerRow, RowBuffers,
+                                Processor.Width, Segment->RowCount, Processor.BitsPerPixel, false);
+            Segment->Scanlines.RowAboveUnknown = (SegmentIndex > 0);
+            AddWorkEntry(DecodePNGSegment, Segment);
+        }
+        CompleteAllWork();
+        
+        for(u32 SegmentIndex = 0; SegmentIndex < SegmentCount; SegmentIndex++)
+        {
+            if(Segments[SegmentIndex].Error)
+            {
+                Divided = false;
+            }
+        }
+    }
+    if(!Divided)
+    {
+        // Without usable hints, or if a segment didn't decode on its own, the whole stream is decoded in one go.
+        png_segment_work *Segment = Segments;
+        u8 *RowBuffers = Segment->Buffers->DeflateBuffer + DeflateBufferSize + DEFLATE_COPY_PADDING;
+        Segment->Spans     = Spans;
+        Segment->SpanCount = SpanCount;
+        Segment->Error     = 0;
+        InitializeScanlines(&Segment->Scanlines, (u8 *)Buffer, RowBuffers,
+                            Processor.Width, Processor.Height, Processor.BitsPerPixel, Interlaced);
+        Segment->Scanlines.FirstStoredRow = FirstStoredRow;
+        Segment->Scanlines.EndRow         = RegionY + RegionHeight;
+        if(Region)
+        {
+            // The rest of the stream doesn't get decoded, so there is nothing to check the checksums against.
+            Segment->Scanlines.Verify = false;
+        }
+        
+        png_preview Preview = {};
+        if(Previewed)
+        {
+            Preview.Processor  = StoredProcessor;
+            Preview.Conversion = (Convert) ? &Conversion : 0;
+            Preview.Converted  = ConvertedBuffer;
+            Segment->Scanlines.Preview = &Preview;
+        }
+        
+        if(Region)
+        {
+            DecodePNGSegment(Segment);
+        }
+        else if(IsStoredStream(Spans, SpanCount))
+        {
+            Segment->Error = InflateStored(Spans, SpanCount, Segment->Buffers->DeflateBuffer, &Segment->Scanlines);
+        }
+        // The previews get stored from this thread, so the passes have to be unfiltered on it.
+        else if(Previewed || !InflateSpeculatively(Spans, SpanCount, CompressedSize, &Segment->Scanlines))
+        {
+            Pipelined = (!Previewed && DecodePNGPipelined(Segment, (Convert) ? &Conversion : 0, ConvertedBuffer));
+            if(!Pipelined)
+            {
+                DecodePNGSegment(Segment);
+            }
+        }
+        if(Segment->Error)
+        {
+            LogError(Segment->Error, "PNG Reader");
+        }
     }
     
-    Inflate(Chunk, FileEndpoint, DeflateBuffers, DeflateBufferSize);
-    UndoFilters(DeflateBuffers->DeflateBuffer, (u8 *)Buffer, RowBuffers,
-                Processor.Width, Processor.Height, Processor.BitsPerPixel);
+    if(VerifyChecksums && !Region)
+    {
+        // The segments only hold the rows of the image, which is all the stream should contain.
+        u32 Adler = Segments[0].Scanlines.Adler;
+        for(u32 SegmentIndex = 1; Divided && SegmentIndex < SegmentCount; SegmentIndex++)
+        {
+            Adler = CombineAdler32(Adler, Segments[SegmentIndex].Scanlines.Adler,
+                                   (u64)Segments[SegmentIndex].RowCount * (1 + BytesPerRow));
+        }
+        if(!SpanCRCsMatch(Spans, SpanCount, FileEndpoint))
+        {
+            CRCsMatch = false;
+        }
+        if(!CRCsMatch)
+        {
+            LogError("The CRC of a chunk doesn't match its contents.", "PNG Reader");
+        }
+        if(!Segments[0].Error && Adler != StoredAdler32(Spans, SpanCount))
+        {
+            LogError("The Adler-32 checksum doesn't match the decoded image data.", "PNG Reader");
+        }
+    }
     
-    StoreImage(Buffer, Processor);
+    if(Convert)
+    {
+        if(!Pipelined)
+        {
+            ConvertRowsInBands(&Conversion, (u8 *)Buffer + (u64)(RegionY - FirstStoredRow) * BytesPerRow,
+                               ConvertedBuffer, 0, RegionHeight);
+        }
+        StoreImage(ConvertedBuffer, StoredProcessor);
+    }
+    else
+    {
+        if(Region)
+        {
+            u64 BytesPerPixel = Processor.BitsPerPixel / 8;
+            CompactRegionRows((u8 *)Buffer, BytesPerRow, RegionY - FirstStoredRow,
+                              RegionX * BytesPerPixel, RegionWidth * BytesPerPixel, RegionHeight);
+        }
+        StoreImage(Buffer, StoredProcessor);
+    }
     
     FreeImageBuffer(Buffer);
     return(true);
@@ -22,6 +22,8 @@
 #define PNG_mDCv 'vCDm'
 #define PNG_cLLi 'iLLc'
 
+#define PNG_iDOT 'TODi'
+
 #define PNG_acTL 'LTca'
 #define PNG_fcTL 'LTcf'
 #define PNG_fdAT 'TAdf'
@@ -77,33 +79,283 @@ struct png_file_header
     u32 CRC;
 };
 
+struct png_animation_control
+{
+    u32 FrameCount;
+    u32 PlayCount;
+};
+
+struct png_frame_control
+{
+    u32 SequenceNumber;
+    u32 Width;
+    u32 Height;
+    u32 OffsetX;
+    u32 OffsetY;
+    u16 DelayNumerator;
+    u16 DelayDenominator;
+    u8 DisposeOp;
+    u8 BlendOp;
+};
+
 #pragma pack(pop)
 
+// After a frame is shown, its region of the canvas is either kept, cleared, or restored to what it was before.
+#define APNG_DISPOSE_OP_NONE       0
+#define APNG_DISPOSE_OP_BACKGROUND 1
+#define APNG_DISPOSE_OP_PREVIOUS   2
+
+#define APNG_BLEND_OP_SOURCE 0
+#define APNG_BLEND_OP_OVER   1
+
+// The data of one IDAT or fdAT chunk, so the bit reader doesn't need to parse chunk headers.
+struct png_data_span
+{
+    png_chunk *Chunk;
+    u8 *Start;// Behind the sequence number for fdAT chunks.
+    u8 *End;
+    u32 CRC;// Of the chunk type and data, once CRCComputed is set.
+    b32 CRCComputed;
+};
+
 struct png_bit_reader
 {
-    u32 Buffer;
+    u64 Buffer;
     u32 StoredBits;
     u8 *NextByte;
     u8 *SegmentEnd;
-    u8 *FileEnd;
+    png_data_span *NextSpan;
+    png_data_span *SpansEnd;
+    u32 ZeroBytes;// Bytes of zeros added behind the end of the data.
+    png_data_span *CheckedSpan;// The CRCs get computed right behind the reader, while the data is still cached.
+    u8 *CheckedByte;
+    u32 CRC;
 };
 
+// Codes up to the root length are resolved with a single lookup. Longer codes find a link
+// entry in the root table with the offset and size of a subtable indexed by the remaining bits.
 struct deflate_code
 {
     u16 Value;
     u8 Length;
+    u8 SubtableBits;
+};
+
+#define DEFLATE_MAX_LENGTH (1 << 4)
+
+#define DEFLATE_CODE_LENGTH_ROOT_BITS 7
+#define DEFLATE_LITERAL_ROOT_BITS     10
+#define DEFLATE_DISTANCE_ROOT_BITS    8
+
+// The root table plus room for the worst case of subtables for 288 or 32 symbols of at most 15 bits.
+#define DEFLATE_LITERAL_DICTIONARY_SIZE  ((1 << DEFLATE_LITERAL_ROOT_BITS) + (1 << 9))
+#define DEFLATE_DISTANCE_DICTIONARY_SIZE ((1 << DEFLATE_DISTANCE_ROOT_BITS) + (1 << 8))
+
+#define DEFLATE_INVALID_CODE U16Max
+
+// Match copies write in blocks of up to 32 bytes and may overshoot the match by that much.
+#define DEFLATE_COPY_PADDING 32
+
+// Back-references reach at most this far, everything before can be discarded once unfiltered.
+#define DEFLATE_WINDOW_SIZE (1 << 15)
+// Space for newly decoded data behind the window, before scanlines get unfiltered and the window slides back.
+#define PNG_STREAM_CHUNK_SIZE (1 << 18)
+
+// Checking the chunk CRCs and the Adler-32 of the zlib stream is optional, corrupt files otherwise
+// decode as far as they go. Build with /DPNG_VERIFY_CHECKSUMS=1 to turn it on.
+#ifndef PNG_VERIFY_CHECKSUMS
+#define PNG_VERIFY_CHECKSUMS 0
+#endif
+
+// Animated PNGs get composed frame by frame into a canvas, which goes to the platform with StoreAnimationFrame.
+// The platform doesn't play animations back yet, so by default the default image gets decoded like any other
+// PNG. Build with /DPNG_ANIMATION_PLAYBACK=1 once the platform stores the frames.
+#ifndef PNG_ANIMATION_PLAYBACK
+#define PNG_ANIMATION_PLAYBACK 0
+#endif
+
+#define CRC32_POLYNOMIAL 0xedb88320// Reflected.
+#define ADLER32_MODULO 65521
+// The most bytes that can be summed up before the second Adler-32 sum overflows 32 bits.
+#define ADLER32_MAX_RUN 5552
+
+struct png_inflate_window
+{
+    u8 *Start;
+    u8 *End;
+    u8 *Unfiltered;// First decoded byte not yet handed to the scanline state.
+    char *Error;
+};
+
+// Undoes one filter type on a scanline, At points behind the filter type byte.
+typedef void png_unfilter_kernel(u8 *At, u8 *To, u8 *RowEnd, u8 *LastRow, u32 BytesPerPixel);
+
+// Tracks the scanline that the next decoded bytes belong to. Pass is the interlace pass,
+// or 0 for images without interlacing.
+struct png_scanline_state
+{
+    u8 *Image;
+    u8 *Row;
+    u8 *LastRow;
+    u32 Width;
+    u32 Height;
+    u32 BitsPerPixel;
+    u32 BytesPerPixel;
+    u64 BytesPerRow;
+    u64 ScanlineLength;
+    png_unfilter_kernel *UnfilterKernels[5];
+    u32 Y;
+    u32 Pass;
+    u32 FirstStoredRow;// Rows above it only pass through the row buffers, the image starts with it.
+    u32 EndRow;// Decoding stops once the rows above it are done.
+    b32 Interlaced;
+    b32 Finished;
+    b32 RowAboveUnknown;// The rows start in the middle of the image, without the row above them.
+    struct png_pipeline *Pipeline;// Set for the inflating thread, while another thread unfilters the rows.
+    struct png_preview *Preview;// Set if the image gets shown after every pass but the last.
+    b32 Verify;
+    u32 Adler;// Adler-32 of the unfiltered scanlines, if Verify is set.
+};
+
+// Large interlaced images get shown after every Adam7 pass, with each decoded pixel repeated over the block
+// that the later passes fill in. The passes then refine the image in place. Build with
+// /DPNG_PROGRESSIVE_PREVIEW=0 to only show the finished image.
+#ifndef PNG_PROGRESSIVE_PREVIEW
+#define PNG_PROGRESSIVE_PREVIEW 1
+#endif
+#define PNG_PREVIEW_MIN_PIXELS (1 << 20)
+
+struct png_preview
+{
+    image_processor_tasks Processor;// Of the stored image.
+    image_conversion *Conversion;
+    u8 *Converted;
 };
 
 struct png_decoding_buffers
 {
     u8 Lengths[320];
     u16 SortingBuffer[288];
-    deflate_code LiteralDictionary[1 << 15];
-    deflate_code DistanceDictionary[1 << 15];
+    deflate_code LiteralDictionary[DEFLATE_LITERAL_DICTIONARY_SIZE];
+    deflate_code DistanceDictionary[DEFLATE_DISTANCE_DICTIONARY_SIZE];
     u8 DeflateBuffer[1];
 };
 
-#define DEFLATE_MAX_LENGTH (1 << 4)
+#define PNG_MAX_SEGMENTS 16
+
+// Apple's iDOT chunk splits the rows into segments with separately compressed data, so they can be
+// decoded in parallel. Offset points from the start of the iDOT chunk to the first IDAT chunk of a
+// segment. The chunk data holds the big endian segment count followed by the segments.
+struct png_idot_segment
+{
+    u32 FirstRow;
+    u32 RowCount;
+    u32 Offset;
+};
+
+struct png_segment_work
+{
+    png_data_span *Spans;
+    u32 SpanCount;
+    u32 FirstRow;
+    u32 RowCount;
+    b32 ZlibHeader;
+    png_decoding_buffers *Buffers;
+    u64 WindowSize;
+    png_scanline_state Scanlines;
+    char *Error;
+};
+
+// With worker threads, the calling thread only inflates, into a window of PNG_PIPELINE_CHUNKS stream chunks
+// past the 32 KB of back-references. A worker unfilters the scanlines behind it and the others convert bands
+// of finished rows. Every progress counter is written by a single thread, the positions count from the start
+// of the decoded stream. The counters only grow and get published with SignalCounter, so the threads that
+// wait for them block in WaitForCounter instead of spinning.
+#define PNG_PIPELINE_CHUNKS 4
+// Set in BytesDecoded once the inflating thread is done, so the unfiltering can wait on a single counter.
+#define PNG_INFLATE_DONE ((u64)1 << 63)
+
+struct png_pipeline
+{
+    u8 *Stream;
+    u64 StreamSize;
+    u64 volatile WindowStart;// Position of the first byte in the window, moves when the window slides back.
+    u64 BytesUnfiltered;// Written in front of ScanlineEnd.
+    u64 volatile BytesDecoded;
+    u64 volatile ScanlineEnd;// The unfiltering waits until the stream is decoded up to here.
+    u64 volatile RowsDone;// Rows of the image that won't change anymore.
+    png_scanline_state *Scanlines;
+};
+
+// Large streams without iDOT hints get split into chunks of compressed data, which are inflated in parallel.
+// Every chunk but the first searches for the start of a block with dynamic tables and decodes without
+// knowing the 32 KB in front of it. The chunks are decoded in waves, so that the speculative entries of one
+// wave fit into the size of the image.
+#define PNG_SPECULATIVE_THRESHOLD  (1 << 21)
+#define PNG_SPECULATIVE_MIN_CHUNK  (1 << 17)// Below this the linking costs more than the chunks save.
+#define PNG_MAX_SPECULATIVE_CHUNKS 64
+// Blocks rarely span more compressed data than this. Without a block start in this range, the chunk is dropped.
+#define PNG_BLOCK_SEARCH_SIZE      (1 << 17)
+// The chunks of a wave read this far past it, to finish their last block.
+#define PNG_SPECULATIVE_OVERLAP    (2 * PNG_BLOCK_SEARCH_SIZE)
+
+// A chunk decodes into u16 entries. Bytes from in front of the chunk are not known yet, so they are
+// stored as PNG_MARKER_BASE plus their position in the window in front of the chunk.
+#define PNG_MARKER_BASE 256
+#define PNG_SPECULATIVE_WINDOW_ENTRIES (DEFLATE_WINDOW_SIZE + (1 << 16))
+
+// Layout of the buffer of the speculative inflate. Besides the decoders, it holds the window of the decoded
+// stream, the resolved 32 KB in front of every chunk, the entries of the chunks and the data of a wave.
+struct png_speculative_plan
+{
+    u32 ChunkCount;// Per wave, the first chunk continues the stream in front of the wave.
+    u64 ChunkSize;// Compressed bytes per chunk.
+    u64 Capacity;// Entries per chunk, a chunk that decodes to more gets dropped.
+    u64 WindowSize;
+    u64 DecoderSize;
+    u64 DataSize;// Zero if the data is a single span, which the chunks read in place.
+    u64 FrontOffset;
+    u64 DecoderOffset;
+    u64 EntryOffset;
+    u64 DataOffset;
+    u64 BufferSize;
+};
+
+// The decoded stream in front of the pending chunks. Once the bytes in front of a chunk are known, it decodes
+// straight into the window.
+struct png_speculative_output
+{
+    png_inflate_window Window;
+    u8 *To;
+    u64 Size;
+    u8 *Front;// The last 32 KB of the stream, for the markers of the first pending chunk.
+    png_scanline_state *Scanlines;
+};
+
+struct png_speculative_chunk
+{
+    u8 *Data;
+    u8 *DataEnd;
+    u64 SearchBit;// Block starts get searched from here up to StopBit.
+    u64 StartBit;
+    u64 StopBit;// Decoding stops at the first block that starts at or behind this bit.
+    u64 EndBit;
+    b32 Found;
+    b32 LastBlock;
+    b32 Probing;// Requires complete codes while testing a possible block start.
+    png_bit_reader Reader;
+    png_decoding_buffers *Buffers;
+    u16 *To;
+    u16 *Emitted;// First entry of the window that is not stored in the entries yet.
+    png_speculative_output *Output;// Set once the chunk decodes into the stream.
+    u16 *Entries;
+    u64 Capacity;
+    u64 Length;
+    u64 Offset;// Position of the first entry in the decoded stream, once the chunks are linked up.
+    u8 *Front;// The resolved 32 KB in front of the chunk.
+    u8 *Tail;// The resolved 32 KB at the end of the chunk, which are in front of the next one.
+    char *Error;
+};
 
 static const u16 DEFLATE_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
 static const u8  DEFLATE_LENGTH_BITS[32] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0, 0, 0, 0};
@@ -115,3 +367,6 @@ static const u8 INTERLACE_X_INCREMENT[7] = { 8, 8, 4, 4, 2, 2, 1 };
 static const u8 INTERLACE_Y_INCREMENT[7] = { 8, 8, 8, 4, 4, 2, 2 };
 static const u8 INTERLACE_X_OFFSET[7]    = { 0, 4, 0, 2, 0, 1, 0 };
 static const u8 INTERLACE_Y_OFFSET[7]    = { 0, 0, 4, 0, 2, 0, 1 };
+// After a pass, every block of this size has its top left pixel decoded.
+static const u8 INTERLACE_BLOCK_WIDTH[7]  = { 8, 4, 4, 2, 2, 1, 1 };
+static const u8 INTERLACE_BLOCK_HEIGHT[7] = { 8, 8, 4, 4, 2, 2, 1 };
@@ -119,6 +119,17 @@ CompileStretchChannelProgram(open_gl *OpenGL, stretch_channel_program *Result)
     return(Program);
 }
 
+static GLuint
+CompileDereferencePalletProgram(open_gl *OpenGL, dereference_pallet_program *Result)
+{
+    GLuint Program = OpenGLCreateProgram(GlobalBasicShaderHeaderCode, DereferencePallet_VertexCode, DereferencePallet_FragmentCode, &Result->Common);
+    
+    Result->ImageID  = glGetUniformLocation(Program, "Image");
+    Result->PalletID = glGetUniformLocation(Program, "Pallet");
+    
+    return(Program);
+}
+
 b32
 OpenGLInitPrograms(open_gl *OpenGL)
 {
@@ -174,6 +185,12 @@ OpenGLInitPrograms(open_gl *OpenGL)
         return(false);
     }
     
+    if(!CompileDereferencePalletProgram(OpenGL, &OpenGL->DereferencePalletProgram))
+    {
+        LogError("Unable to compile the pallet dereferencing program.", "OpenGL");
+        return(false);
+    }
+    
     return(true);
 }
 
@@ -255,6 +272,21 @@ OpenGLProgramEnd(stretch_channel_program *Program)
     OpenGLProgramEnd(&Program->Common);
 }
 
+// The indices are read from the first texture unit, the pallet from the second.
+static void
+OpenGLProgramBegin(dereference_pallet_program *Program)
+{
+    OpenGLProgramBegin(&Program->Common);
+    
+    glUniform1i(Program->ImageID, 0);
+    glUniform1i(Program->PalletID, 1);
+}
+static void
+OpenGLProgramEnd(dereference_pallet_program *Program)
+{
+    OpenGLProgramEnd(&Program->Common);
+}
+
 static GLuint
 GenerateImageTexture(open_gl *OpenGL, GLenum Format, GLenum Type, u32 Width, u32 Height, void *Data)
 {
@@ -306,6 +338,38 @@ DeleteFramebuffer(frame_buffer Framebuffer)
     }
 }
 
+// Gray images with 8 or 16 bits per channel, with or without alpha, get uploaded as they are. That only saves the
+// conversion and upload, they still get drawn into the same GL_RGBA32F image as any other.
+static b32
+GetGrayFormat(image_processor_tasks *Processor, GLint *InternalFormat, GLenum *DataFormat, GLenum *DataType)
+{
+    u64 GrayMask = Processor->RedMask;
+    u32 ChannelSize = (GrayMask == 0xffff) ? 16 : 8;
+    if((GrayMask != 0xff && GrayMask != 0xffff) ||
+       Processor->GreenMask != GrayMask || Processor->BlueMask != GrayMask ||
+       Processor->PalletSize || Processor->TransparentColor)
+    {
+        return(false);
+    }
+    
+    if(Processor->AlphaMask == 0 && Processor->BitsPerPixel == ChannelSize)
+    {
+        *InternalFormat = (ChannelSize == 16) ? GL_R16 : GL_R8;
+        *DataFormat = GL_RED;
+    }
+    else if(Processor->AlphaMask == (GrayMask << ChannelSize) && Processor->BitsPerPixel == ChannelSize * 2)
+    {
+        *InternalFormat = (ChannelSize == 16) ? GL_RG16 : GL_RG8;
+        *DataFormat = GL_RG;
+    }
+    else
+    {
+        return(false);
+    }
+    *DataType = (ChannelSize == 16) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+    return(true);
+}
+
 void
 SetImageBuffer(open_gl *OpenGL, void *Data, image_processor_tasks Processor)
 {
@@ -314,6 +378,9 @@ SetImageBuffer(open_gl *OpenGL, void *Data, image_processor_tasks Processor)
     
     frame_buffer Buffer;
     frame_buffer SwapBuffer;
+    GLint  GrayInternalFormat = 0;
+    GLenum GrayDataFormat = 0;
+    GLenum GrayDataType = 0;
     
     glViewport(0, 0, Processor.Width,   Processor.Height);
     glPixelStorei(GL_UNPACK_SWAP_BYTES, Processor.BigEndian);
@@ -352,6 +419,79 @@ SetImageBuffer(open_gl *OpenGL, void *Data, image_processor_tasks Processor)
         
         // TODO(Zyonji): If subsampling was used, interpolate the stretched channels.
     }
+    else if(GetGrayFormat(&Processor, &GrayInternalFormat, &GrayDataFormat, &GrayDataType))
+    {
+        // The gray channel only gets spread over RGB by the swizzle, while it's drawn into the image.
+        GLint Swizzle[4] = {GL_RED, GL_RED, GL_RED, (Processor.AlphaMask) ? GL_GREEN : GL_ONE};
+        GLuint Texture = 0;
+        
+        glGenTextures(1, &Texture);
+        glBindTexture(GL_TEXTURE_2D, Texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GrayInternalFormat,
+                     Processor.Width, Processor.Height, 0, GrayDataFormat, GrayDataType, Data);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, Swizzle);
+        
+        Buffer = CreateFramebuffer(OpenGL, GL_RGBA, GL_UNSIGNED_BYTE,
+                                   Processor.Width, Processor.Height, 0);
+        
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, Buffer.FramebufferHandle);
+        glBindTexture(GL_TEXTURE_2D, Texture);
+        
+        OpenGLProgramBegin(&OpenGL->FlipTextureProgram, 0, 0, 1, 1);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        OpenGLProgramEnd(&OpenGL->FlipTextureProgram);
+        
+        glDeleteTextures(1, &Texture);
+        
+        glBindTexture(GL_TEXTURE_2D, Buffer.ColorHandle);
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
+    else if(Processor.PalletSize && Processor.BitsPerPixel == 8)
+    {
+        // The indices get uploaded as they are and are looked up in the pallet while they're drawn into the
+        // GL_RGBA32F image, after which both textures are gone. The pallet is padded to 256 colors, indices past
+        // its end stay transparent black.
+        u32 *Pallet = (u32 *)RequestImageBuffer(GetConversionPalletSize(Processor.PalletSize) * sizeof(u32));
+        image_conversion Conversion;
+        PrepareConversion(&Conversion, Processor, Pallet, false);
+        
+        Buffer = CreateFramebuffer(OpenGL, GL_RGBA, GL_UNSIGNED_BYTE,
+                                   Processor.Width, Processor.Height, 0);
+        
+        GLuint Textures[2] = {};
+        glGenTextures(2, Textures);
+        
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, Textures[1]);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 256, 1, 0, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV, Pallet);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, Textures[0]);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, Processor.ByteAlignment);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, Processor.Width, Processor.Height, 0, GL_RED, GL_UNSIGNED_BYTE, Data);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, Buffer.FramebufferHandle);
+        
+        OpenGLProgramBegin(&OpenGL->DereferencePalletProgram);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        OpenGLProgramEnd(&OpenGL->DereferencePalletProgram);
+        
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glActiveTexture(GL_TEXTURE0);
+        glDeleteTextures(2, Textures);
+        FreeImageBuffer(Pallet);
+        
+        glBindTexture(GL_TEXTURE_2D, Buffer.ColorHandle);
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
     else
     {
         GLenum DataFormat = 0;
@@ -384,108 +524,42 @@ SetImageBuffer(open_gl *OpenGL, void *Data, image_processor_tasks Processor)
             if(Processor.BigEndian)
             {
                 glPixelStorei(GL_UNPACK_SWAP_BYTES, false);
-                Processor.RedMask   = SwapEndian(Processor.RedMask);
-                Processor.GreenMask = SwapEndian(Processor.GreenMask);
-                Processor.BlueMask  = SwapEndian(Processor.BlueMask);
-                Processor.AlphaMask = SwapEndian(Processor.AlphaMask);
             }
             
             u32 MaximumChannelSize = 0;
-            channel_location RedLocation = GetChannelLocation(Processor.RedMask);
-            if(RedLocation.BitCount > MaximumChannelSize)
-            {
-                MaximumChannelSize = RedLocation.BitCount;
-            }
-            channel_location GreenLocation = GetChannelLocation(Processor.GreenMask);
-            if(GreenLocation.BitCount > MaximumChannelSize)
-            {
-                MaximumChannelSize = GreenLocation.BitCount;
-            }
-            channel_location BlueLocation = GetChannelLocation(Processor.BlueMask);
-            if(BlueLocation.BitCount > MaximumChannelSize)
-            {
-                MaximumChannelSize = BlueLocation.BitCount;
-            }
-            channel_location AlphaLocation = GetChannelLocation(Processor.AlphaMask);
-            if(AlphaLocation.BitCount > MaximumChannelSize)
+            u64 Masks[4] = {Processor.RedMask, Processor.GreenMask, Processor.BlueMask, Processor.AlphaMask};
+            for(u32 Channel = 0; Channel < 4; Channel++)
             {
-                MaximumChannelSize = AlphaLocation.BitCount;
+                u8 BitCount = GetChannelLocation(Masks[Channel]).BitCount;
+                if(BitCount > MaximumChannelSize)
+                {
+                    MaximumChannelSize = BitCount;
+                }
             }
             
-#if 0
-            // TODO(Zyonji): Currently the textures are stored as 8 bit per channel, making higher precision superfluous. Reconsider after having settled on a texture storage format.
-            if(MaximumChannelSize > 8)
-                RearrangeChannelsToU64();
-            else
-                RearrangeChannelsToU32();
-#endif
+            // Channels with more than 8 bits are kept at 16 bit, the texture stores them as floats.
+            b32 Wide = (MaximumChannelSize > 8 && Processor.PalletSize == 0);
+            u32 BytesPerPixel = (Wide) ? 8 : 4;
+            u64 ImageSize = (u64)Processor.Width * Processor.Height;
+            u64 DataSize = ImageSize * BytesPerPixel + (u64)GetConversionPalletSize(Processor.PalletSize) * 4;
+            void *NewData = RequestImageBuffer(DataSize);
             
-            // Expects the byte alignment to be a power of 2.
-            u32 BitMask = Processor.ByteAlignment - 1;
-            u32 BytesPerRow = ((Processor.BitsPerPixel * Processor.Width + 7) / 8 + BitMask) & (~BitMask);
+            image_conversion Conversion;
+            PrepareConversion(&Conversion, Processor, (u32 *)((u8 *)NewData + ImageSize * BytesPerPixel), Wide);
+            ConvertRowsInBands(&Conversion, Data, NewData, 0, Processor.Height);
             
-            if(Processor.PalletSize == 0)
+            if(Wide)
             {
-                u64 DataSize = Processor.Width * Processor.Height * 4;
-                void *NewData = RequestImageBuffer(DataSize);
-                
-                RearrangeChannelsToU32(Data, NewData,
-                                       Processor.RedMask,   Processor.GreenMask,
-                                       Processor.BlueMask,  Processor.AlphaMask, 
-                                       RedLocation.Offset,  GreenLocation.Offset,
-                                       BlueLocation.Offset, AlphaLocation.Offset,
-                                       Processor.Width, Processor.Height, BytesPerRow,
-                                       Processor.BitsPerPixel, Processor.BigEndian);
-                
-                if(Processor.TransparentColor)
-                {
-                    u32 TransparentColor;
-                    RearrangeChannelsToU32(&Processor.TransparentColor, &TransparentColor,
-                                           Processor.RedMask,   Processor.GreenMask,
-                                           Processor.BlueMask,  Processor.AlphaMask, 
-                                           RedLocation.Offset,  GreenLocation.Offset,
-                                           BlueLocation.Offset, AlphaLocation.Offset,
-                                           1, 1, 0,
-                                           Processor.BitsPerPixel, Processor.BigEndian);
-                    
-                    void *LastPixel = (u8 *)NewData + DataSize;
-                    for(u32 *Pixel = (u32 *)NewData; Pixel < LastPixel; Pixel++)
-                    {
-                        if(*Pixel == TransparentColor)
-                        {
-                            *Pixel &= 0xffffff;
-                        }
-                    }
-                }
-                
-                Buffer = CreateFramebuffer(OpenGL, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV,
+                Buffer = CreateFramebuffer(OpenGL, GL_RGBA, GL_UNSIGNED_SHORT,
                                            Processor.Width, Processor.Height, NewData);
-                
-                FreeImageBuffer(NewData);
             }
             else
             {
-                u64 ImageSize = Processor.Width * Processor.Height;
-                u64 DataSize = ImageSize * 4 + Processor.PalletSize * 4;
-                void *NewData = RequestImageBuffer(DataSize);
-                u32 *NewPalletData = ((u32 *)NewData) + ImageSize;
-                
-                RearrangeChannelsToU32(Processor.PalletData, NewPalletData,
-                                       Processor.RedMask,  Processor.GreenMask,
-                                       Processor.BlueMask, Processor.AlphaMask, 
-                                       RedLocation.Offset,  GreenLocation.Offset,
-                                       BlueLocation.Offset, AlphaLocation.Offset,
-                                       Processor.PalletSize, 1, 0, 
-                                       Processor.BitsPerPalletColor, Processor.BigEndian);
-                
-                DereferenceColorIndex(Data, NewData, NewPalletData, Processor.PalletSize,
-                                      Processor.Width, Processor.Height, BytesPerRow, Processor.BitsPerPixel);
-                
                 Buffer = CreateFramebuffer(OpenGL, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV,
                                            Processor.Width, Processor.Height, NewData);
-                
-                FreeImageBuffer(NewData);
             }
+            
+            FreeImageBuffer(NewData);
         }
     }
     
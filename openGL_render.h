@@ -33,6 +33,13 @@ struct stretch_channel_program
     GLuint SampleXID;
     GLuint SampleYID;
 };
+struct dereference_pallet_program
+{
+    render_program_base Common;
+    
+    GLuint ImageID;
+    GLuint PalletID;
+};
 
 struct frame_buffer
 {
@@ -54,6 +61,7 @@ struct open_gl
     flip_texture_program    FlipTextureProgram;
     DCT_program             DCTProgram;
     stretch_channel_program StretchChannelProgram;
+    dereference_pallet_program DereferencePalletProgram;
 };
 
 struct channel_mask_map
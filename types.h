@@ -55,6 +55,7 @@ typedef intptr_t smm;
 #define PointerFromU32(type, Value) (type *)((memory_index)Value)
 
 #define ArrayCount(Array) (sizeof(Array) / sizeof((Array)[0]))
+#define AlignPow2(Value, Alignment) (((Value) + ((Alignment) - 1)) & ~((u64)(Alignment) - 1))
 #define OffsetOf(type, Member) (umm)&(((type *)0)->Member)
 
 #define TWOCC(String) (*(u16 *)(String))
@@ -23,8 +23,13 @@
 #define GL_BGR                                  0x80E0
 #define GL_BGRA                                 0x80E1
 #define GL_CLAMP_TO_EDGE                        0x812F
+#define GL_TEXTURE0                             0x84C0
+#define GL_TEXTURE1                             0x84C1
 #define GL_RG                                   0x8227
 #define GL_R8                                   0x8229
+#define GL_R16                                  0x822A
+#define GL_RG8                                  0x822B
+#define GL_RG16                                 0x822C
 #define GL_RGBA_INTEGER                         0x8D99
 
 #define GL_UNSIGNED_BYTE_3_3_2                  0x8032
@@ -48,6 +53,7 @@
 #define GL_LINK_STATUS                          0x8B82
 #define GL_DRAW_FRAMEBUFFER                     0x8CA9
 #define GL_COLOR_ATTACHMENT0                    0x8CE0
+#define GL_TEXTURE_SWIZZLE_RGBA                 0x8E46
 #define GL_FRAMEBUFFER                          0x8D40
 
 typedef char GLchar;
@@ -94,6 +100,7 @@ typedef void WINAPI type_glGenVertexArrays(GLsizei n, GLuint *arrays);
 typedef void WINAPI type_glBindVertexArray(GLuint array);
 
 typedef void WINAPI type_glGenerateMipmap(GLenum target);
+typedef void WINAPI type_glActiveTexture(GLenum texture);
 
 #define OpenGLGlobalFunction(Name) static type_##Name *Name
 
@@ -138,6 +145,7 @@ OpenGLGlobalFunction(glGenVertexArrays);
 OpenGLGlobalFunction(glBindVertexArray);
 
 OpenGLGlobalFunction(glGenerateMipmap);
+OpenGLGlobalFunction(glActiveTexture);
 
 #undef OpenGLGlobalFunction
 
@@ -184,6 +192,7 @@ LoadOpenGLFunctions()
     WGLGetOpenGLFunction(glBindVertexArray);
     
     WGLGetOpenGLFunction(glGenerateMipmap);
+    WGLGetOpenGLFunction(glActiveTexture);
     
 #undef WGLGetOpenGLFunction
     return true;
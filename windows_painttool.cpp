@@ -1,4 +1,5 @@
 #include "types.h"// Definition of variable types.
+#include <intrin.h>// SIMD and CPU feature intrinsics.
 
 /*
 PAINTTOOL_CODE_VERIFICATION:
@@ -22,7 +23,14 @@ void LogError(char*, char*);
 void* RequestImageBuffer(u64);
 void FreeImageBuffer(void*);
 void StoreImage(void*, image_processor_tasks);
+b32 StoreAnimationFrame(void*, image_processor_tasks, u32, u32);
+void StorePreviewImage(void*, image_processor_tasks);
 void OutputDebugNumber(s32 Number, u8 BitCount);
+void AddWorkEntry(platform_work_callback *Callback, void *Data);
+void CompleteAllWork();
+u32 WorkerThreadCount();
+u64 WaitForCounter(u64 volatile*, u64);
+void SignalCounter(u64 volatile*, u64);
 
 #include "fileprocessor/imageprocessor.cpp"
 
@@ -39,6 +47,11 @@ void OutputDebugNumber(s32 Number, u8 BitCount);
 
 static win_global Global;
 
+// The decoders add at most this many entries before completing them, the pipelined unfiltering with its conversion
+// bands, the iDOT segments or the speculative chunks. Nothing checks for a full queue at run time.
+static_assert(1 + CONVERSION_BANDS + PNG_MAX_SEGMENTS + PNG_MAX_SPECULATIVE_CHUNKS < ArrayCount(Global.WorkQueue.Entries),
+              "The work queue is too small for the entries the decoders add.");
+
 void
 LogError(char *Text, char *Caption)
 {
@@ -55,6 +68,130 @@ OutputDebugNumber(s32 Number, u8 BitCount)
     OutputDebugStringA(Buffer);
 }
 
+void
+AddWorkEntry(platform_work_callback *Callback, void *Data)
+{
+    work_queue *Queue = &Global.WorkQueue;
+    u32 NewNextEntryToWrite = (Queue->NextEntryToWrite + 1) % ArrayCount(Queue->Entries);
+    Assert(NewNextEntryToWrite != Queue->NextEntryToRead);
+    work_queue_entry *Entry = Queue->Entries + Queue->NextEntryToWrite;
+    Entry->Callback = Callback;
+    Entry->Data = Data;
+    ++Queue->CompletionGoal;
+    // Publishes the entry with release semantics, before any thread can claim it.
+    InterlockedExchange((LONG volatile *)&Queue->NextEntryToWrite, NewNextEntryToWrite);
+    ReleaseSemaphore(Queue->Semaphore, 1, 0);
+}
+
+static b32
+DoNextWorkEntry(work_queue *Queue)// Returns true if there was no work left.
+{
+    u32 OriginalNextEntryToRead = Queue->NextEntryToRead;
+    if(OriginalNextEntryToRead == Queue->NextEntryToWrite)
+    {
+        return(true);
+    }
+    
+    u32 NewNextEntryToRead = (OriginalNextEntryToRead + 1) % ArrayCount(Queue->Entries);
+    u32 Index = InterlockedCompareExchange((LONG volatile *)&Queue->NextEntryToRead,
+                                           NewNextEntryToRead, OriginalNextEntryToRead);
+    if(Index == OriginalNextEntryToRead)
+    {
+        work_queue_entry Entry = Queue->Entries[Index];
+        Entry.Callback(Entry.Data);
+        InterlockedIncrement((LONG volatile *)&Queue->CompletionCount);
+    }
+    return(false);
+}
+
+// The calling thread helps out until every added entry is done.
+void
+CompleteAllWork()
+{
+    work_queue *Queue = &Global.WorkQueue;
+    while(Queue->CompletionGoal != Queue->CompletionCount)
+    {
+        DoNextWorkEntry(Queue);
+    }
+    Queue->CompletionGoal = 0;
+    Queue->CompletionCount = 0;
+}
+
+// Doesn't count the calling thread, which works on the queue in CompleteAllWork.
+u32
+WorkerThreadCount()
+{
+    return(Global.WorkQueue.ThreadCount);
+}
+
+// Blocks until the counter reaches Target and returns the value it saw. The load has acquire semantics, so
+// everything written in front of the matching SignalCounter is visible.
+u64
+WaitForCounter(u64 volatile *Counter, u64 Target)
+{
+    u64 Value = (u64)InterlockedCompareExchange64((LONG64 volatile *)Counter, 0, 0);
+    while(Value < Target)
+    {
+        WaitOnAddress(Counter, &Value, sizeof(Value), INFINITE);
+        Value = (u64)InterlockedCompareExchange64((LONG64 volatile *)Counter, 0, 0);
+    }
+    return(Value);
+}
+
+// Stores the new value with release semantics and wakes the threads waiting on the counter.
+void
+SignalCounter(u64 volatile *Counter, u64 Value)
+{
+    InterlockedExchange64((LONG64 volatile *)Counter, (LONG64)Value);
+    WakeByAddressAll((void *)Counter);
+}
+
+static DWORD WINAPI
+WorkerThreadProc(LPVOID Parameter)
+{
+    work_queue *Queue = (work_queue *)Parameter;
+    for(;;)
+    {
+        if(DoNextWorkEntry(Queue))
+        {
+            WaitForSingleObjectEx(Queue->Semaphore, INFINITE, FALSE);
+        }
+    }
+}
+
+// Starts one worker thread for every logical processor except this one. The PAINTTOOL_WORKER_THREADS environment
+// variable can lower that count, with 0 all of the work stays on the main thread.
+static void
+InitWorkQueue(work_queue *Queue)
+{
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    u32 ThreadCount = SystemInfo.dwNumberOfProcessors - 1;
+    
+    char Setting[16];
+    DWORD SettingLength = GetEnvironmentVariableA(WORKER_THREADS_VARIABLE, Setting, sizeof(Setting));
+    if(SettingLength > 0 && SettingLength < sizeof(Setting) && Setting[0] >= '0' && Setting[0] <= '9')
+    {
+        u32 RequestedCount = 0;
+        for(char *At = Setting; *At >= '0' && *At <= '9' && RequestedCount < ThreadCount; At++)
+        {
+            RequestedCount = RequestedCount * 10 + (u32)(*At - '0');
+        }
+        if(RequestedCount < ThreadCount)
+        {
+            ThreadCount = RequestedCount;
+        }
+    }
+    Queue->ThreadCount = ThreadCount;
+    
+    Queue->Semaphore = CreateSemaphoreExA(0, 0, ArrayCount(Queue->Entries), 0, 0, SEMAPHORE_ALL_ACCESS);
+    for(u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ThreadIndex++)
+    {
+        HANDLE ThreadHandle = CreateThread(0, 0, WorkerThreadProc, Queue, 0, 0);
+        CloseHandle(ThreadHandle);
+    }
+}
+
 static void
 SetPixelFormat(HDC WindowDC)
 {
@@ -211,6 +348,17 @@ StoreImage(void *Bitmap, image_processor_tasks Processor)
     }
 }
 
+// The decoder still runs from inside the message loop, so the window gets painted right away.
+void
+StorePreviewImage(void *Bitmap, image_processor_tasks Processor)
+{
+    StoreImage(Bitmap, Processor);
+    if(Global.Window)
+    {
+        RedrawWindow(Global.Window, 0, 0, RDW_INVALIDATE | RDW_UPDATENOW);
+    }
+}
+
 static void
 DisplayImageFromFile(char *FilePath, HWND Window)
 {
@@ -426,6 +574,9 @@ WinMain(HINSTANCE Instance, HINSTANCE PrevInstance, LPSTR CommandLine, int ShowC
     {
         return(0);
     }
+    Global.Window = Window;
+    
+    InitWorkQueue(&Global.WorkQueue);
     
     if(CommandLine && *CommandLine != '\0')
     {
@@ -1,9 +1,29 @@
 #define PAINT_TOOL_WINDOW_CLASS_NAME "Zyonji's PaintTool Window"
 #define PAINT_TOOL_WINDOW_NAME       "Zyonji's PaintTool"
+#define WORKER_THREADS_VARIABLE      "PAINTTOOL_WORKER_THREADS"
+
+struct work_queue_entry
+{
+    platform_work_callback *Callback;
+    void *Data;
+};
+
+struct work_queue
+{
+    u32 volatile CompletionGoal;
+    u32 volatile CompletionCount;
+    u32 volatile NextEntryToWrite;
+    u32 volatile NextEntryToRead;
+    HANDLE Semaphore;
+    u32 ThreadCount;
+    work_queue_entry Entries[256];
+};
 
 struct win_global
 {
+    work_queue WorkQueue;
     open_gl OpenGL;
     b32 Initialized;
     HGLRC RenderingContext;
+    HWND Window;// For painting while an image is still decoding.
 };
\ No newline at end of file